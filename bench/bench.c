@@ -0,0 +1,838 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../dsp.h"
+
+// Microbenchmarks of the codecs, the shared-key cache, the filter of find
+//  requests, the routing table, the listeners and the node store.  Each is run
+//  for about RUN_SECONDS, on one thread unless said otherwise, and reports a
+//  rate.
+#define RUN_SECONDS 0.5
+// Number of nodes stored before timing lookups
+#define STORED_NODES 50000
+// Number of nodes in the host's routing table
+#define TABLE_NODES 2000
+// Number of sessions each client thread sends requests over, one after the
+//  other
+#define CLIENT_SESSIONS 4
+// Number of threads looking up and writing to the routing table at once
+#define TABLE_READERS 16
+#define TABLE_WRITERS 2
+// Number of connections held open at once by the handshake bench, fewer if
+//  the limit on open files is too low for both of their ends, and how many
+//  of them are handshaking at a time
+#define HANDSHAKES 10000
+#define HANDSHAKE_WINDOW 128
+
+static double now (void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void report (char const *name, double rate, char const *unit)
+{
+    if (rate >= 1e6) printf("%-36s %9.2f M%s/s\n", name, rate / 1e6, unit);
+    else printf("%-36s %9.2f k%s/s\n", name, rate / 1e3, unit);
+}
+
+static void fill (unsigned char *buffer, size_t length)
+{
+    for (size_t i = 0; i < length; i++) buffer[i] = rand();
+}
+
+static void bench_base64 (void)
+{
+    enum { LENGTH = 4096 };
+    static unsigned char in[LENGTH], out[LENGTH];
+    static char text[BASE64_LENGTH(LENGTH) + 1];
+    fill(in, LENGTH);
+    long n = 0;
+    double start = now(), elapsed;
+    do {
+        for (int i = 0; i < 64; i++, n++) encode_base64(text, in, LENGTH);
+    } while ((elapsed = now() - start) < RUN_SECONDS);
+    report("base64 encode, 4 KiB", n * LENGTH / elapsed, "B");
+    n = 0;
+    start = now();
+    do {
+        for (int i = 0; i < 64; i++, n++) {
+            size_t size = LENGTH;
+            dsp_error err = decode_base64(out, &size, text, strlen(text));
+            if (err) {
+                log_error(err);
+                dsp_error_free(err);
+                return;
+            }
+        }
+    } while ((elapsed = now() - start) < RUN_SECONDS);
+    report("base64 decode, 4 KiB", n * LENGTH / elapsed, "B");
+}
+
+static void bench_hash (void)
+{
+    enum { LENGTH = 1 << 22, BLOCK = 4096, BLOCKS = 64 };
+    unsigned char *in = malloc(LENGTH);
+    if (!in) return;
+    fill(in, LENGTH);
+    unsigned char out[BLOCKS][HASH_LENGTH];
+    long n = 0;
+    double start = now(), elapsed;
+    do {
+        hash(in, LENGTH, out[0]);
+        n++;
+    } while ((elapsed = now() - start) < RUN_SECONDS);
+    report("hash, 4 MiB", (double) n * LENGTH / elapsed, "B");
+    unsigned char const *blocks[BLOCKS];
+    for (int i = 0; i < BLOCKS; i++) blocks[i] = in + i * BLOCK;
+    n = 0;
+    start = now();
+    do {
+        hash_many(blocks, BLOCK, out, BLOCKS);
+        n++;
+    } while ((elapsed = now() - start) < RUN_SECONDS);
+    report("hash_many, 64 x 4 KiB", (double) n * BLOCKS * BLOCK / elapsed,
+            "B");
+    free(in);
+}
+
+// Boxes 64-byte messages to one peer, computing the shared key for each box
+//  as crypto_box does, then taking it from the cache
+static void bench_boxes (struct dsp *dsp)
+{
+    enum { LENGTH = 64 };
+    unsigned char *peer, *peer_private;
+    dsp_error err = encrypt_keypair(&peer, &peer_private);
+    if (err) {
+        log_error(err);
+        dsp_error_free(err);
+        return;
+    }
+    unsigned char in[LENGTH], out[MAC_LENGTH + LENGTH];
+    unsigned char nonce[NONCE_LENGTH] = {0}, key[SHARED_KEY_LENGTH];
+    fill(in, LENGTH);
+    long n = 0;
+    double start = now(), elapsed;
+    do {
+        precompute(key, peer, dsp->private_key);
+        encrypt(out, in, LENGTH, nonce, key);
+        n++;
+    } while ((elapsed = now() - start) < RUN_SECONDS);
+    report("box, key computed per message", n / elapsed, "msg");
+    n = 0;
+    start = now();
+    do {
+        for (int i = 0; i < 256; i++, n++) {
+            shared_key(dsp, peer, key);
+            encrypt(out, in, LENGTH, nonce, key);
+        }
+    } while ((elapsed = now() - start) < RUN_SECONDS);
+    report("box, cached shared key", n / elapsed, "msg");
+    free(peer);
+    free(peer_private);
+}
+
+static void random_node (struct node *node)
+{
+    memset(node, 0, sizeof(struct node));
+    fill(node->fingerprint, HASH_LENGTH);
+    fill(node->public_key, PUBLIC_KEY_LENGTH);
+    snprintf(node->address, ADDRESS_LENGTH, "10.%d.%d.%d:%d", rand() % 256,
+            rand() % 256, rand() % 256, 1024 + rand() % 60000);
+}
+
+// Nodes at random fingerprints fill the lower buckets, as on a live node
+static void fill_table (struct dsp *dsp, int n)
+{
+    struct node node;
+    for (int i = 0; i < n; i++) {
+        random_node(&node);
+        add_node(&node, dsp);
+    }
+}
+
+// A session with a listener over a blocking socket, framed and sealed as by
+//  net.c
+struct client {
+    int socket;
+    unsigned char id[CONNECTION_ID_LENGTH];
+    unsigned char key[SESSION_KEY_LENGTH];
+    uint64_t sent;
+    uint64_t received;
+};
+
+// Returns a socket connected to the port on the loopback address, or -1
+static int dial (uint16_t port)
+{
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1) return -1;
+    struct sockaddr_in address = {AF_INET, htons(port),
+        {htonl(INADDR_LOOPBACK)}};
+    int enable = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    if (connect(s, (struct sockaddr *) &address, sizeof(address))) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+static bool send_frame (int socket, unsigned char *frame, size_t length)
+{
+    uint32_t header = htonl(length - FRAME_HEADER_LENGTH);
+    memcpy(frame, &header, FRAME_HEADER_LENGTH);
+    return send(socket, frame, length, MSG_NOSIGNAL) == (ssize_t) length;
+}
+
+static bool recv_frame (int socket, unsigned char *frame, size_t *length)
+{
+    uint32_t header;
+    if (recv(socket, &header, FRAME_HEADER_LENGTH, MSG_WAITALL)
+            != FRAME_HEADER_LENGTH)
+        return false;
+    *length = ntohl(header);
+    return *length <= MAX_FRAME_LENGTH && recv(socket, frame, *length,
+            MSG_WAITALL) == (ssize_t) *length;
+}
+
+// client_open runs a full handshake with <server> as <client>
+static bool client_open (struct dsp *client, struct dsp *server,
+        struct client *c)
+{
+    unsigned char hello[FRAME_HEADER_LENGTH + MSG_HELLO_LENGTH];
+    unsigned char secret[PRIVATE_KEY_LENGTH], welcome[MAX_FRAME_LENGTH];
+    size_t length;
+    struct ticket ticket;
+    if ((c->socket = dial(server->tcp_port)) == -1) return false;
+    // Each session has a key of its own, so nonces may repeat across them
+    memset(c->id, 0, CONNECTION_ID_LENGTH);
+    c->sent = c->received = 0;
+    session_hello(client, server->public_key, c->id, secret,
+            hello + FRAME_HEADER_LENGTH);
+    dsp_error err = NULL;
+    if (!send_frame(c->socket, hello, sizeof(hello))
+            || !recv_frame(c->socket, welcome, &length)
+            || (err = session_welcomed(server->public_key, secret, welcome,
+                    length, &ticket))) {
+        if (err) dsp_error_free(err);
+        close(c->socket);
+        return false;
+    }
+    memcpy(c->key, ticket.key, SESSION_KEY_LENGTH);
+    return true;
+}
+
+// client_send sends a find request for <target>, with an empty filter
+static bool client_send (struct client *c, unsigned char const *target)
+{
+    unsigned char message[MSG_FIND_LENGTH], filter[BLOOM_LENGTH] = {0};
+    unsigned char frame[FRAME_HEADER_LENGTH + 1 + MAC_LENGTH
+        + MSG_FIND_LENGTH];
+    unsigned char nonce[NONCE_LENGTH];
+    msg_find(message, target, filter);
+    frame[FRAME_HEADER_LENGTH] = MSG_SEALED;
+    session_nonce(c->id, c->sent++, 0, nonce);
+    seal(frame + FRAME_HEADER_LENGTH + 1, message, MSG_FIND_LENGTH, nonce,
+            c->key);
+    return send_frame(c->socket, frame, sizeof(frame));
+}
+
+// client_receive reads and opens the response to the oldest request
+static bool client_receive (struct client *c)
+{
+    unsigned char frame[MAX_FRAME_LENGTH], reply[MAX_MESSAGE_LENGTH];
+    unsigned char nonce[NONCE_LENGTH];
+    size_t length;
+    if (!recv_frame(c->socket, frame, &length) || length < 1 + MAC_LENGTH
+            || frame[0] != MSG_SEALED)
+        return false;
+    session_nonce(c->id, c->received++, 1, nonce);
+    dsp_error err = unseal(reply, frame + 1, length - 1, nonce, c->key);
+    if (err) dsp_error_free(err);
+    return !err;
+}
+
+// The host's listeners run until the process exits, each on its own thread
+static void *run_listener (void *arg)
+{
+    struct listener *listener = arg;
+    dsp_error err = net_listen(listener->dsp, listener->socket);
+    if (err) {
+        log_error(err);
+        dsp_error_free(err);
+    }
+    return NULL;
+}
+
+// Starts <n> listeners of the host on a port of its own, and returns false if
+//  any failed to start
+static bool start_listeners (struct dsp *dsp, int n)
+{
+    struct listener *listeners = calloc(n, sizeof(struct listener));
+    if (!listeners) return false;
+    dsp->tcp_port = 0;
+    for (int i = 0; i < n; i++) {
+        listeners[i].dsp = dsp;
+        dsp_error err = net_bind(dsp, &listeners[i].socket);
+        if (err) {
+            log_error(err);
+            dsp_error_free(err);
+            return false;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_listener, &listeners[i]))
+            return false;
+        pthread_detach(thread);
+    }
+    return true;
+}
+
+struct client_thread {
+    pthread_t thread;
+    struct dsp *client;
+    struct dsp *server;
+    pthread_barrier_t *start;
+    atomic_bool *stop;
+    long requests;
+    bool failed;
+};
+
+// Sends find requests for random targets on each session in turn, one
+//  pipelined request per session, until told to stop
+static void *run_client (void *arg)
+{
+    struct client_thread *t = arg;
+    struct client sessions[CLIENT_SESSIONS];
+    int n = 0;
+    while (n < CLIENT_SESSIONS && client_open(t->client, t->server,
+                &sessions[n]))
+        n++;
+    t->failed = n < CLIENT_SESSIONS;
+    pthread_barrier_wait(t->start);
+    unsigned seed = (uintptr_t) t;
+    unsigned char target[HASH_LENGTH];
+    while (!t->failed && !atomic_load(t->stop)) {
+        for (int i = 0; i < n && !t->failed; i++) {
+            for (int j = 0; j < HASH_LENGTH; j++) target[j] = rand_r(&seed);
+            t->failed = !client_send(&sessions[i], target);
+        }
+        for (int i = 0; i < n && !t->failed; i++)
+            t->failed = !client_receive(&sessions[i]);
+        if (!t->failed) t->requests += n;
+    }
+    for (int i = 0; i < n; i++) close(sessions[i].socket);
+    return NULL;
+}
+
+// Find requests answered by 1, 2, 4 and so on up to one listener per
+//  processor, each time from one client thread per processor (at least two)
+//  over CLIENT_SESSIONS sessions each.  Clients run on the same processors, so
+//  the rate scales with listeners only up to about half of them.
+static void bench_listeners (struct dsp *server, struct dsp *client)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    int num_clients = cpus < 2 ? 2 : cpus;
+    struct client_thread *threads = calloc(num_clients,
+            sizeof(struct client_thread));
+    if (!threads) return;
+    for (int n = 1;; n = 2 * n < cpus ? 2 * n : cpus) {
+        if (!start_listeners(server, n)) break;
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, num_clients + 1);
+        atomic_bool stop = false;
+        for (int i = 0; i < num_clients; i++) {
+            threads[i] = (struct client_thread) {.client = client,
+                .server = server, .start = &start, .stop = &stop};
+            pthread_create(&threads[i].thread, NULL, run_client, &threads[i]);
+        }
+        pthread_barrier_wait(&start);
+        double begin = now();
+        usleep(RUN_SECONDS * 1e6);
+        atomic_store(&stop, true);
+        long requests = 0;
+        bool failed = false;
+        for (int i = 0; i < num_clients; i++) {
+            pthread_join(threads[i].thread, NULL);
+            requests += threads[i].requests;
+            failed |= threads[i].failed;
+        }
+        double elapsed = now() - begin;
+        pthread_barrier_destroy(&start);
+        char name[64];
+        snprintf(name, sizeof(name), "find requests, %d listener%s", n,
+                n > 1 ? "s" : "");
+        if (failed) printf("%-36s    failed\n", name);
+        else report(name, requests / elapsed, "req");
+        if (n == cpus) break;
+    }
+    free(threads);
+}
+
+// Upserts are timed until the writer has committed them, on closing
+// Compares the Bloom filter of known nodes sent with each find request to an
+//  explicit list of their fingerprints, as sealed frame bytes and as the time
+//  to build and seal the request at the sender and to check a hop's
+//  2 * LOOKUP_K nodes against it, half of which are known.  The list is
+//  scanned, and takes a count byte after the target.
+static void bench_filter (void)
+{
+    enum { MAX_KNOWN = 4 * LOOKUP_K + 1, CHECKED = 2 * LOOKUP_K };
+    unsigned char known[MAX_KNOWN][HASH_LENGTH];
+    unsigned char checked[CHECKED][HASH_LENGTH];
+    unsigned char filter[BLOOM_LENGTH];
+    unsigned char message[1 + HASH_LENGTH + 1 + MAX_KNOWN * HASH_LENGTH];
+    unsigned char sealed[MAC_LENGTH + sizeof(message)];
+    unsigned char key[SESSION_KEY_LENGTH], nonce[NONCE_LENGTH];
+    unsigned char target[HASH_LENGTH], *list = message + 2 + HASH_LENGTH;
+    fill(key, SESSION_KEY_LENGTH);
+    fill(nonce, NONCE_LENGTH);
+    fill(target, HASH_LENGTH);
+    fill(known[0], sizeof(known));
+    fill(checked[0], sizeof(checked));
+    for (int i = 0; i < CHECKED; i += 2)
+        memcpy(checked[i], known[i / 2], HASH_LENGTH);
+    size_t overhead = FRAME_HEADER_LENGTH + 1 + MAC_LENGTH;
+    // The sender's own fingerprint is always among the known nodes
+    for (int n = LOOKUP_K + 1; n <= MAX_KNOWN; n += 3 * LOOKUP_K) {
+        char name[64];
+        unsigned sink = 0;
+        snprintf(name, sizeof(name), "find bytes, %d known, Bloom", n);
+        printf("%-36s %9zu B\n", name, overhead + MSG_FIND_LENGTH);
+        snprintf(name, sizeof(name), "find bytes, %d known, list", n);
+        printf("%-36s %9zu B\n", name,
+                overhead + 1 + HASH_LENGTH + 1 + n * HASH_LENGTH);
+        long ops = 0;
+        double start = now(), elapsed;
+        do {
+            memset(filter, 0, BLOOM_LENGTH);
+            for (int i = 0; i < n; i++) bloom_add(filter, known[i]);
+            seal(sealed, message, msg_find(message, target, filter), nonce,
+                    key);
+            sink += sealed[ops++ % MSG_FIND_LENGTH];
+        } while ((elapsed = now() - start) < RUN_SECONDS);
+        snprintf(name, sizeof(name), "Bloom build and seal, %d known", n);
+        report(name, ops / elapsed, "req");
+        ops = 0;
+        start = now();
+        do {
+            message[0] = MSG_FIND;
+            memcpy(message + 1, target, HASH_LENGTH);
+            list[-1] = n;
+            memcpy(list, known, n * HASH_LENGTH);
+            seal(sealed, message, 2 + HASH_LENGTH + n * HASH_LENGTH, nonce,
+                    key);
+            sink += sealed[ops++ % (n * HASH_LENGTH)];
+        } while ((elapsed = now() - start) < RUN_SECONDS);
+        snprintf(name, sizeof(name), "list build and seal, %d known", n);
+        report(name, ops / elapsed, "req");
+        int false_positives = 0;
+        for (int j = 1; j < CHECKED; j += 2)
+            false_positives += bloom_contains(filter, checked[j]);
+        ops = 0;
+        start = now();
+        do {
+            for (int j = 0; j < CHECKED; j++)
+                sink += bloom_contains(filter, checked[j]);
+            ops++;
+        } while ((elapsed = now() - start) < RUN_SECONDS);
+        snprintf(name, sizeof(name), "Bloom check, %d known", n);
+        report(name, ops / elapsed, "req");
+        ops = 0;
+        start = now();
+        do {
+            for (int j = 0; j < CHECKED; j++) {
+                int i = 0;
+                while (i < n && memcmp(list + i * HASH_LENGTH, checked[j],
+                            HASH_LENGTH))
+                    i++;
+                sink += i < n;
+            }
+            ops++;
+        } while ((elapsed = now() - start) < RUN_SECONDS);
+        snprintf(name, sizeof(name), "list check, %d known", n);
+        report(name, ops / elapsed, "req");
+        if (false_positives || !sink)
+            printf("%-36s %9d\n", "Bloom false positives", false_positives);
+    }
+}
+
+// A client connection of the handshake bench, from the connect to the end of
+//  the welcome
+struct handshake {
+    int socket;
+    bool connected;
+    size_t received;
+    double start;
+    double latency;
+    unsigned char secret[PRIVATE_KEY_LENGTH];
+    unsigned char hello[FRAME_HEADER_LENGTH + MSG_HELLO_LENGTH];
+    unsigned char welcome[FRAME_HEADER_LENGTH + MSG_WELCOME_LENGTH];
+};
+
+static int compare_latencies (void const *a, void const *b)
+{
+    double x = ((struct handshake const *) a)->latency;
+    double y = ((struct handshake const *) b)->latency;
+    return x < y ? -1 : x > y;
+}
+
+// Returns false if the connection failed
+static bool start_handshake (int epoll, uint16_t port, struct handshake *h)
+{
+    h->start = now();
+    h->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (h->socket == -1) return false;
+    struct sockaddr_in address = {AF_INET, htons(port),
+        {htonl(INADDR_LOOPBACK)}};
+    int enable = 1;
+    setsockopt(h->socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    struct epoll_event event = {EPOLLOUT, {.ptr = h}};
+    return (!connect(h->socket, (struct sockaddr *) &address, sizeof(address))
+            || errno == EINPROGRESS)
+        && !epoll_ctl(epoll, EPOLL_CTL_ADD, h->socket, &event);
+}
+
+// Sends the hello once connected, and reads the welcome.  Returns false if
+//  the connection failed, and sets the latency once the welcome is in.
+static bool step_handshake (int epoll, struct handshake *h)
+{
+    if (!h->connected) {
+        int err;
+        socklen_t length = sizeof(int);
+        if (getsockopt(h->socket, SOL_SOCKET, SO_ERROR, &err, &length) || err)
+            return false;
+        h->connected = true;
+        uint32_t header = htonl(MSG_HELLO_LENGTH);
+        memcpy(h->hello, &header, FRAME_HEADER_LENGTH);
+        struct epoll_event event = {EPOLLIN, {.ptr = h}};
+        return send(h->socket, h->hello, sizeof(h->hello), MSG_NOSIGNAL)
+            == sizeof(h->hello)
+            && !epoll_ctl(epoll, EPOLL_CTL_MOD, h->socket, &event);
+    }
+    ssize_t n = recv(h->socket, h->welcome + h->received,
+            sizeof(h->welcome) - h->received, 0);
+    if (n <= 0) return n == -1 && errno == EAGAIN;
+    if ((h->received += n) == sizeof(h->welcome)) {
+        h->latency = now() - h->start;
+        epoll_ctl(epoll, EPOLL_CTL_DEL, h->socket, NULL);
+    }
+    return true;
+}
+
+// Opens up to HANDSHAKES connections to the host's listeners, and keeps them
+//  all open until the last is welcomed.  Hellos come from as many new
+//  identities, and are made beforehand.  Welcomes are opened afterwards, so
+//  that the client's own crypto is not timed.
+static void bench_handshakes (struct dsp *server)
+{
+    enum { EVENTS = 256 };
+    struct rlimit limit;
+    int n = HANDSHAKES;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+        // Both ends of each connection are open in this process
+        if (limit.rlim_cur != RLIM_INFINITY
+                && (rlim_t) 2 * n + 256 > limit.rlim_cur)
+            n = limit.rlim_cur > 256 ? (limit.rlim_cur - 256) / 2 : 0;
+    }
+    struct handshake *handshakes;
+    if (!n || !(handshakes = calloc(n, sizeof(struct handshake)))) return;
+    unsigned char id[CONNECTION_ID_LENGTH] = {0};
+    // The shared-key cache is by peer only, so each identity needs its own
+    for (int i = 0; i < n; i++) {
+        struct dsp identity = {0};
+        dsp_error err = encrypt_keypair(&identity.public_key,
+                &identity.private_key);
+        if (err || (err = keys_open(&identity.keys))) {
+            free(identity.public_key);
+            free(identity.private_key);
+            dsp_error_free(err);
+            free(handshakes);
+            return;
+        }
+        session_hello(&identity, server->public_key, id, handshakes[i].secret,
+                handshakes[i].hello + FRAME_HEADER_LENGTH);
+        keys_close(identity.keys);
+        free(identity.public_key);
+        free(identity.private_key);
+        handshakes[i].socket = -1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll == -1 || !start_listeners(server, cpus > 0 ? cpus : 1)) {
+        if (epoll != -1) close(epoll);
+        free(handshakes);
+        return;
+    }
+    int started = 0, done = 0, failed = 0;
+    struct epoll_event events[EVENTS];
+    double begin = now(), deadline = begin + 60;
+    while (done + failed < n && now() < deadline) {
+        for (; started < n && started - done - failed < HANDSHAKE_WINDOW;
+                started++)
+            if (!start_handshake(epoll, server->tcp_port,
+                        &handshakes[started]))
+                failed++;
+        int m = epoll_wait(epoll, events, EVENTS, 100);
+        for (int i = 0; i < m; i++) {
+            struct handshake *h = events[i].data.ptr;
+            if (!step_handshake(epoll, h)) {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, h->socket, NULL);
+                failed++;
+            } else if (h->latency) {
+                done++;
+            }
+        }
+    }
+    double elapsed = now() - begin;
+    close(epoll);
+    int welcomed = 0;
+    for (int i = 0; i < n; i++) {
+        struct handshake *h = &handshakes[i];
+        struct ticket ticket;
+        dsp_error err;
+        if (h->socket != -1) close(h->socket);
+        if (!h->latency) continue;
+        if (err = session_welcomed(server->public_key, h->secret,
+                    h->welcome + FRAME_HEADER_LENGTH, MSG_WELCOME_LENGTH,
+                    &ticket))
+            dsp_error_free(err);
+        else welcomed++;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "handshakes, %d connections", n);
+    if (welcomed < n) {
+        printf("%-36s    %d failed\n", name, n - welcomed);
+    } else {
+        report(name, n / elapsed, "session");
+        qsort(handshakes, n, sizeof(struct handshake), compare_latencies);
+        printf("%-36s %9.2f ms\n", "handshake latency, p99",
+                handshakes[(n * 99 + 99) / 100 - 1].latency * 1e3);
+    }
+    free(handshakes);
+}
+
+struct table_thread {
+    pthread_t thread;
+    struct dsp *dsp;
+    struct hash *known;             // fingerprints of nodes in the table
+    int num_known;
+    bool writer;
+    pthread_barrier_t *start;
+    atomic_bool *stop;
+    long operations;
+};
+
+// Readers alternate closest_nodes and return_node.  Writers report exchanges
+//  with known nodes, and add a new node every fourth operation.
+static void *run_table_thread (void *arg)
+{
+    struct table_thread *t = arg;
+    unsigned seed = (uintptr_t) t;
+    struct node nodes[LOOKUP_K];
+    struct hash target;
+    pthread_barrier_wait(t->start);
+    while (!atomic_load(t->stop)) {
+        struct hash *known = &t->known[rand_r(&seed) % t->num_known];
+        if (!t->writer) {
+            for (int j = 0; j < HASH_LENGTH; j++)
+                target.hash[j] = rand_r(&seed);
+            closest_nodes(&target, LOOKUP_K, t->dsp, nodes);
+            return_node(known, t->dsp, nodes);
+        } else if (t->operations % 4) {
+            report_exchange(known, rand_r(&seed) % 8, 0.001 * (1
+                        + rand_r(&seed) % 100), t->dsp);
+        } else {
+            memset(nodes, 0, sizeof(struct node));
+            for (int j = 0; j < HASH_LENGTH; j++)
+                nodes[0].fingerprint[j] = rand_r(&seed);
+            for (int j = 0; j < PUBLIC_KEY_LENGTH; j++)
+                nodes[0].public_key[j] = rand_r(&seed);
+            snprintf(nodes[0].address, ADDRESS_LENGTH, "10.0.%d.%d:%d",
+                    rand_r(&seed) % 256, rand_r(&seed) % 256,
+                    1024 + rand_r(&seed) % 60000);
+            add_node(&nodes[0], t->dsp);
+        }
+        t->operations += t->writer ? 1 : 2;
+    }
+    return NULL;
+}
+
+// Runs TABLE_READERS readers with no writers, then alongside TABLE_WRITERS
+//  writers, so that the cost of the writers to the readers shows
+static void bench_table (struct dsp *dsp)
+{
+    enum { KNOWN = 256 };
+    struct hash known[KNOWN];
+    struct node nodes[LOOKUP_K];
+    int num_known = 0;
+    while (num_known < KNOWN) {
+        struct hash target;
+        fill(target.hash, HASH_LENGTH);
+        int n = closest_nodes(&target, LOOKUP_K, dsp, nodes);
+        if (!n) return;
+        for (int i = 0; i < n && num_known < KNOWN; i++)
+            memcpy(known[num_known++].hash, nodes[i].fingerprint, HASH_LENGTH);
+    }
+    struct table_thread threads[TABLE_READERS + TABLE_WRITERS];
+    for (int writers = 0; writers <= TABLE_WRITERS; writers += TABLE_WRITERS) {
+        int num_threads = TABLE_READERS + writers;
+        pthread_barrier_t start;
+        pthread_barrier_init(&start, NULL, num_threads + 1);
+        atomic_bool stop = false;
+        for (int i = 0; i < num_threads; i++) {
+            threads[i] = (struct table_thread) {.dsp = dsp, .known = known,
+                .num_known = num_known, .writer = i >= TABLE_READERS,
+                .start = &start, .stop = &stop};
+            pthread_create(&threads[i].thread, NULL, run_table_thread,
+                    &threads[i]);
+        }
+        pthread_barrier_wait(&start);
+        double begin = now();
+        usleep(RUN_SECONDS * 1e6);
+        atomic_store(&stop, true);
+        long reads = 0, writes = 0;
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i].thread, NULL);
+            if (threads[i].writer) writes += threads[i].operations;
+            else reads += threads[i].operations;
+        }
+        double elapsed = now() - begin;
+        pthread_barrier_destroy(&start);
+        char name[64];
+        snprintf(name, sizeof(name), "table reads, %d readers, %d writers",
+                TABLE_READERS, writers);
+        report(name, reads / elapsed, "op");
+        if (writers) {
+            snprintf(name, sizeof(name), "table writes, %d writers", writers);
+            report(name, writes / elapsed, "op");
+        }
+    }
+}
+
+static dsp_error bench_db (void)
+{
+    enum { BATCH = 32 };
+    struct db *db;
+    dsp_error err;
+    if (err = db_open(&db)) return err;
+    unsigned char (*stored)[HASH_LENGTH] = malloc(STORED_NODES * HASH_LENGTH);
+    if (!stored) {
+        db_close(db);
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate nodes");
+    }
+    struct node node;
+    double start = now();
+    for (int i = 0; !err && i < STORED_NODES; i++) {
+        random_node(&node);
+        memcpy(stored[i], node.fingerprint, HASH_LENGTH);
+        err = store_node(db, &node);
+    }
+    if (!err) err = db_close(db);
+    report("node upserts, committed", STORED_NODES / (now() - start), "row");
+    if (err || (err = db_open(&db))) {
+        free(stored);
+        return err;
+    }
+    unsigned char fingerprints[BATCH][HASH_LENGTH];
+    struct node nodes[BATCH];
+    bool found[BATCH];
+    long n = 0;
+    double elapsed = 0;
+    start = now();
+    do {
+        for (int i = 0; !err && i < BATCH; i++, n++) {
+            struct node *row;
+            if (!(err = select_node(db, stored[rand() % STORED_NODES], &row)))
+                free(row);
+        }
+    } while (!err && (elapsed = now() - start) < RUN_SECONDS);
+    if (!err) report("select_node, looped", n / elapsed, "row");
+    n = 0;
+    start = now();
+    while (!err) {
+        for (int i = 0; i < BATCH; i++)
+            memcpy(fingerprints[i], stored[rand() % STORED_NODES],
+                    HASH_LENGTH);
+        err = select_nodes(db,
+                (unsigned char const (*)[HASH_LENGTH]) fingerprints, BATCH,
+                nodes, found);
+        n += BATCH;
+        if ((elapsed = now() - start) >= RUN_SECONDS) break;
+    }
+    if (!err) report("select_nodes, 32 at a time", n / elapsed, "row");
+    free(stored);
+    dsp_error close = db_close(db);
+    if (err && close) dsp_error_free(close);
+    return err ? err : close;
+}
+
+static void remove_store (void)
+{
+    unlink("db");
+    unlink("db-wal");
+    unlink("db-shm");
+}
+
+int main (int argc, char *argv[])
+{
+    srand(1);
+    // The store is created in the working directory, and removed afterwards
+    char dir[] = "/tmp/dsp-bench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir)) {
+        perror("Failed to create database directory");
+        return 1;
+    }
+    bench_base64();
+    bench_hash();
+    struct dsp dsp = {0}, client = {0};
+    dsp_error err;
+    if ((err = encrypt_keypair(&dsp.public_key, &dsp.private_key))
+            || (err = keys_open(&dsp.keys))
+            || (err = encrypt_keypair(&client.public_key, &client.private_key))
+            || (err = keys_open(&client.keys))) {
+        log_error(err);
+        dsp_error_free(err);
+        return 1;
+    }
+    bench_boxes(&dsp);
+    bench_filter();
+    // Listeners keep running, and the host's state is not freed
+    fingerprint(dsp.public_key, dsp.fingerprint);
+    fill(dsp.ticket_key, SESSION_KEY_LENGTH);
+    if ((err = db_open(&dsp.db)) || (err = nodes_open(&dsp.nodes))
+            || (err = offload_open(&dsp.offload, CRYPTO_THREADS))) {
+        log_error(err);
+        dsp_error_free(err);
+        return 1;
+    }
+    fill_table(&dsp, TABLE_NODES);
+    bench_listeners(&dsp, &client);
+    bench_table(&dsp);
+    bench_handshakes(&dsp);
+    if (!(err = db_close(dsp.db))) {
+        remove_store();
+        err = bench_db();
+    }
+    remove_store();
+    rmdir(dir);
+    if (err) {
+        log_error(err);
+        dsp_error_free(err);
+        return 1;
+    }
+    return 0;
+}
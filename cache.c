@@ -0,0 +1,199 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsp.h"
+
+// Entry links are indices into the entry array; NONE ends a list
+#define NONE UINT32_MAX
+
+// A negative entry records that a fingerprint could not be found
+struct entry {
+    unsigned char fingerprint[HASH_LENGTH];
+    bool found;
+    time_t expires;
+    uint32_t chain;
+    uint32_t previous;
+    uint32_t next;
+    struct node node;
+};
+
+// The cache preallocates as many entries as fit in its memory cap.  Entries
+//  are chained in a hash table by fingerprint, and kept on a list in least-
+//  recently-used order; unused entries are on a free list linked through
+//  <next>.
+struct cache {
+    pthread_mutex_t mutex;
+    uint32_t capacity;
+    uint32_t num_chains;
+    uint32_t *chains;
+    struct entry *entries;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t free;
+    struct cache_stats stats;
+};
+
+/// Static functions
+
+static time_t now (void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec;
+}
+
+static uint32_t *chain_of (struct cache *cache,
+        unsigned char const *fingerprint)
+{
+    uint32_t h;
+    memcpy(&h, fingerprint, sizeof(uint32_t));
+    return &cache->chains[h & (cache->num_chains - 1)];
+}
+
+static uint32_t find_entry (struct cache *cache,
+        unsigned char const *fingerprint)
+{
+    uint32_t i = *chain_of(cache, fingerprint);
+    while (i != NONE && memcmp(cache->entries[i].fingerprint, fingerprint,
+                HASH_LENGTH))
+        i = cache->entries[i].chain;
+    return i;
+}
+
+static void unlink_lru (struct cache *cache, uint32_t i)
+{
+    struct entry *entry = &cache->entries[i];
+    if (entry->previous != NONE) cache->entries[entry->previous].next =
+        entry->next;
+    else cache->head = entry->next;
+    if (entry->next != NONE) cache->entries[entry->next].previous =
+        entry->previous;
+    else cache->tail = entry->previous;
+}
+
+static void push_lru (struct cache *cache, uint32_t i)
+{
+    struct entry *entry = &cache->entries[i];
+    entry->previous = NONE;
+    entry->next = cache->head;
+    if (cache->head != NONE) cache->entries[cache->head].previous = i;
+    else cache->tail = i;
+    cache->head = i;
+}
+
+static void remove_entry (struct cache *cache, uint32_t i)
+{
+    uint32_t *p = chain_of(cache, cache->entries[i].fingerprint);
+    while (*p != i) p = &cache->entries[*p].chain;
+    *p = cache->entries[i].chain;
+    unlink_lru(cache, i);
+    cache->entries[i].next = cache->free;
+    cache->free = i;
+}
+
+/// Extern functions
+
+dsp_error cache_open (struct cache **cache, size_t size)
+{
+    if (!(*cache = calloc(1, sizeof(struct cache))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate cache");
+    (*cache)->capacity = size / (sizeof(struct entry) + sizeof(uint32_t));
+    assert((*cache)->capacity > 0);
+    // Power of two no smaller than the capacity, at one chain per entry
+    for ((*cache)->num_chains = 1; (*cache)->num_chains < (*cache)->capacity;
+            (*cache)->num_chains <<= 1);
+    (*cache)->chains = malloc((*cache)->num_chains * sizeof(uint32_t));
+    (*cache)->entries = malloc((*cache)->capacity * sizeof(struct entry));
+    if (!(*cache)->chains || !(*cache)->entries) {
+        dsp_error err = sys_error(DSP_E_SYSTEM, errno,
+                "Failed to allocate cache");
+        free((*cache)->chains);
+        free((*cache)->entries);
+        free(*cache);
+        *cache = NULL;
+        return err;
+    }
+    for (uint32_t i = 0; i < (*cache)->num_chains; i++)
+        (*cache)->chains[i] = NONE;
+    for (uint32_t i = 0; i < (*cache)->capacity; i++)
+        (*cache)->entries[i].next = i + 1 < (*cache)->capacity ? i + 1 : NONE;
+    (*cache)->free = 0;
+    (*cache)->head = (*cache)->tail = NONE;
+    pthread_mutex_init(&(*cache)->mutex, NULL);
+    return NULL;
+}
+
+void cache_close (struct cache *cache)
+{
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->chains);
+    free(cache->entries);
+    free(cache);
+}
+
+int cache_get (struct cache *cache, unsigned char const *fingerprint,
+        struct node *node)
+{
+    int result = CACHE_MISS;
+    pthread_mutex_lock(&cache->mutex);
+    uint32_t i = find_entry(cache, fingerprint);
+    if (i != NONE && cache->entries[i].expires <= now()) {
+        remove_entry(cache, i);
+        i = NONE;
+    }
+    if (i == NONE) {
+        cache->stats.misses++;
+    } else {
+        struct entry *entry = &cache->entries[i];
+        unlink_lru(cache, i);
+        push_lru(cache, i);
+        if (entry->found) {
+            *node = entry->node;
+            cache->stats.hits++;
+            result = CACHE_FOUND;
+        } else {
+            cache->stats.negative_hits++;
+            result = CACHE_NOT_FOUND;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return result;
+}
+
+void cache_put (struct cache *cache, unsigned char const *fingerprint,
+        struct node *node)
+{
+    pthread_mutex_lock(&cache->mutex);
+    uint32_t i = find_entry(cache, fingerprint);
+    if (i != NONE) {
+        unlink_lru(cache, i);
+    } else {
+        if (cache->free == NONE) {
+            // Evict the least recently used entry
+            remove_entry(cache, cache->tail);
+            cache->stats.evictions++;
+        }
+        i = cache->free;
+        cache->free = cache->entries[i].next;
+        memcpy(cache->entries[i].fingerprint, fingerprint, HASH_LENGTH);
+        uint32_t *chain = chain_of(cache, fingerprint);
+        cache->entries[i].chain = *chain;
+        *chain = i;
+    }
+    struct entry *entry = &cache->entries[i];
+    entry->found = node;
+    if (node) entry->node = *node;
+    entry->expires = now() + (node ? CACHE_TTL : CACHE_NEGATIVE_TTL);
+    push_lru(cache, i);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void cache_stats (struct cache *cache, struct cache_stats *stats)
+{
+    pthread_mutex_lock(&cache->mutex);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->mutex);
+}
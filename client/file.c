@@ -2,10 +2,12 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <nacl/crypto_hash_sha256.h>
 
 #include "client.h"
 
+// Number of blocks read at once, enough to fill the hashing lanes
+#define BATCH_BLOCKS 8
+
 struct file {
     char *path;
     uint64_t length;
@@ -31,17 +33,20 @@ int file_identify (struct file *file)
     int i = 0, n, num_blocks = file->length / block_size
                                             + (file_length % block_size ? 1: 0);
     file->manifest = malloc(32 * num_blocks);
-    void *buffer = malloc(block_size);
+    // Blocks are read and hashed several at a time
+    size_t batch = BATCH_BLOCKS * block_size;
+    void *buffer = malloc(batch);
     do {
-        n = fread(buffer, block_size, 1, fd);
-        crypto_hash_sha256(manifest + i, buffer, n);
-        i += 32;
-    } while (n == block_size);
+        n = fread(buffer, 1, batch, fd);
+        dsp_hash_blocks(buffer, n, block_size,
+                (unsigned char *) file->manifest + i);
+        i += DSP_HASH_LENGTH * ((n + block_size - 1) / block_size);
+    } while (n == batch);
     if (ferror(fd)) return -1;
     assert(feof(fd));
     close(fd);
     free(buffer);
-    crypto_hash_sha256(file->identifier, manifest, 32 * num_blocks);
+    dsp_hash(file->manifest, 32 * num_blocks, file->identifier);
     if (symlink(path, file->identifier)) return -1;
     return 0;
 }
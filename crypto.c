@@ -1,100 +1,470 @@
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
+#include <nacl/crypto_box.h>
 #include <nacl/crypto_hash.h>
+#include <nacl/crypto_secretbox.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86
+#endif
 #include "dsp.h"
 
+static_assert(crypto_hash_BYTES >= HASH_LENGTH,
+        "HASH_LENGTH must not exceed that of NaCl's hash");
+static_assert(crypto_box_NONCEBYTES == NONCE_LENGTH
+        && crypto_secretbox_NONCEBYTES == NONCE_LENGTH,
+        "NONCE_LENGTH must match NaCl");
+static_assert(crypto_box_ZEROBYTES - crypto_box_BOXZEROBYTES == MAC_LENGTH
+        && crypto_secretbox_ZEROBYTES - crypto_secretbox_BOXZEROBYTES
+        == MAC_LENGTH, "MAC_LENGTH must match NaCl");
+static_assert(crypto_secretbox_KEYBYTES == SESSION_KEY_LENGTH,
+        "SESSION_KEY_LENGTH must match NaCl");
+static_assert(crypto_box_BEFORENMBYTES == SHARED_KEY_LENGTH,
+        "SHARED_KEY_LENGTH must match NaCl");
+
+// Shared keys with other nodes are kept by their public key in a direct-mapped
+//  table: a node's key replaces whichever shared its entry.
+struct keys {
+    pthread_mutex_t mutex;
+    struct {
+        bool used;
+        unsigned char peer[PUBLIC_KEY_LENGTH];
+        unsigned char key[SHARED_KEY_LENGTH];
+    } entries[KEY_CACHE_SIZE];
+};
+
 // Hash functions
 
-struct hash *hash (void *in, size_t length)
+void fingerprint (unsigned char const *public_key, unsigned char *out)
 {
-    assert(crypto_hash_BYTES >= HASH_LENGTH);
     unsigned char h[crypto_hash_BYTES];
-    crypto_hash(h, in, length);
-    struct hash *out = malloc(sizeof(struct hash));
-    memcpy(out->hash, h, HASH_LENGTH);
-    return out;
+    crypto_hash(h, public_key, PUBLIC_KEY_LENGTH);
+    memcpy(out, h, HASH_LENGTH);
+}
+
+// Loads 8 bytes as a big-endian word, so that the leading bits of the hash are
+//  the most significant
+static uint64_t load_word (unsigned char const *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(uint64_t));
+    return be64toh(word);
 }
 
-int hash_distance (struct hash *from, struct hash *to)
+int hash_distance (unsigned char const *from, unsigned char const *to)
 {
-    for (int i = 0; i < HASH_LENGTH; i++)
-        if (from->hash[i] != to->hash[i]) return HASH_LENGTH - i;
+    for (int i = 0; i < HASH_LENGTH; i += sizeof(uint64_t)) {
+        uint64_t x = load_word(from + i) ^ load_word(to + i);
+        if (x) return 8 * (HASH_LENGTH - i) - __builtin_clzll(x);
+    }
+    return 0;
+}
+
+int hash_compare (unsigned char const *target, unsigned char const *a,
+        unsigned char const *b)
+{
+    for (int i = 0; i < HASH_LENGTH; i += sizeof(uint64_t)) {
+        uint64_t t = load_word(target + i);
+        uint64_t x = load_word(a + i) ^ t, y = load_word(b + i) ^ t;
+        if (x != y) return x < y ? -1 : 1;
+    }
     return 0;
 }
 
 // Base-64 functions
 
-char *base64_encode (void *in, size_t length)
-{
-    unsigned char *input = (unsigned char *) in;
-    char *output = malloc((4 * ((length + 2) / 3) + 1) * sizeof(char));
-    for (int i = 0, j = 0; i < length; i += 3){
-        unsigned int group = input[i] << 16;
-        if (length - i > 1) group += input[i + 1] << 8;
-        if (length - i > 2) group += input[i + 2];
-        for (int k = 0; k < 4; k++) {
-            unsigned char c = (group & (0x3f << (18 - k * 6))) >> (18 - k * 6);
-            if (c <= 25) c += 'A';
-            else if (c <= 51) c += 'a' - 26;
-            else if (c <= 61) c = '0' - 52;
-            else if (c == 62) c = '+';
-            else c = '/';
-            if (((length - i == 1) && k >= 2) || ((length - i == 2) && k == 3))
-                output[j + k] = '=';
-            else
-                output[j + k] = c;
-        }
+static char const base64_alphabet[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Values of base-64 characters, with every other character mapped to 0xff
+static unsigned char const base64_values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,   62, 0xff, 0xff, 0xff,   63,
+      52,   53,   54,   55,   56,   57,   58,   59,   60,   61, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff,    0,    1,    2,    3,    4,    5,    6,
+       7,    8,    9,   10,   11,   12,   13,   14,   15,   16,   17,   18,
+      19,   20,   21,   22,   23,   24,   25, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,
+      37,   38,   39,   40,   41,   42,   43,   44,   45,   46,   47,   48,
+      49,   50,   51, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff
+};
+
+// Vector kernels for whole blocks, picked once by what the processor
+//  supports; each returns how many input bytes it consumed
+static size_t (*encode_blocks) (char *out, unsigned char const *in,
+        size_t length);
+static size_t (*decode_blocks) (unsigned char *out, unsigned char const *in,
+        size_t length, size_t decoded);
+static pthread_once_t base64_once = PTHREAD_ONCE_INIT;
+
+#ifdef X86
+// The vector kernels follow Muła and Lemire: 12 bytes are spread over the
+//  four 16-bit halves of each 32-bit word, split into 6-bit indices with
+//  multiplies, and mapped to characters by adding an offset looked up by
+//  range.  Decoding classifies each character by its nibbles, and packs the
+//  6-bit values back with multiply-adds.  The AVX2 kernels run the same steps
+//  on two 128-bit lanes at once.
+__attribute__((target("ssse3")))
+static __m128i encode_block (__m128i in)
+{
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5,
+                3, 4, 1, 2, 0, 1));
+    __m128i indices = _mm_or_si128(
+            _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                _mm_set1_epi32(0x04000040)),
+            _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                _mm_set1_epi32(0x01000010)));
+    // 13 for A-Z, 0 for a-z, 1-10 for 0-9, 11 for + and 12 for /
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(
+                _mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                _mm_set1_epi8(13)));
+    __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+            '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(indices, _mm_shuffle_epi8(offsets, range));
+}
+
+// Returns false if any of the 16 characters is not base-64
+__attribute__((target("ssse3")))
+static bool decode_block (__m128i in, __m128i *out)
+{
+    __m128i high = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+    __m128i low = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+    __m128i low_class = _mm_shuffle_epi8(_mm_setr_epi8(0x15, 0x11, 0x11,
+                0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b,
+                0x1b, 0x1b, 0x1a), low);
+    __m128i high_class = _mm_shuffle_epi8(_mm_setr_epi8(0x10, 0x10, 0x01,
+                0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10,
+                0x10, 0x10, 0x10), high);
+    __m128i valid = _mm_cmpeq_epi8(_mm_and_si128(low_class, high_class),
+            _mm_setzero_si128());
+    if (_mm_movemask_epi8(valid) != 0xffff) return false;
+    __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+    __m128i offsets = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65,
+                -71, -71, 0, 0, 0, 0, 0, 0, 0, 0), _mm_add_epi8(slash, high));
+    in = _mm_add_epi8(in, offsets);
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    *out = _mm_shuffle_epi8(in, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14,
+                13, 12, -1, -1, -1, -1));
+    return true;
+}
+
+__attribute__((target("ssse3")))
+static size_t encode_ssse3 (char *out, unsigned char const *in, size_t length)
+{
+    size_t i = 0, j = 0;
+    for (; length - i >= 16; i += 12, j += 16)
+        _mm_storeu_si128((__m128i *) (out + j),
+                encode_block(_mm_loadu_si128((__m128i const *) (in + i))));
+    return i;
+}
+
+__attribute__((target("ssse3")))
+static size_t decode_ssse3 (unsigned char *out, unsigned char const *in,
+        size_t length, size_t decoded)
+{
+    size_t i = 0, j = 0;
+    for (; length - i >= 20 && decoded - j >= 16; i += 16, j += 12) {
+        __m128i block;
+        if (!decode_block(_mm_loadu_si128((__m128i const *) (in + i)), &block))
+            break;
+        _mm_storeu_si128((__m128i *) (out + j), block);
+    }
+    return i;
+}
+
+// Each lane takes 12 bytes, read 16 at a time
+__attribute__((target("avx2")))
+static size_t encode_avx2 (char *out, unsigned char const *in, size_t length)
+{
+    size_t i = 0, j = 0;
+    __m256i order = _mm256_broadcastsi128_si256(_mm_set_epi8(10, 11, 9, 10,
+                7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    __m256i offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8('a' - 26,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63,
+                'A', 0, 0));
+    for (; length - i >= 28; i += 24, j += 32) {
+        __m256i block = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                    _mm_loadu_si128((__m128i const *) (in + i))),
+                _mm_loadu_si128((__m128i const *) (in + i + 12)), 1);
+        block = _mm256_shuffle_epi8(block, order);
+        __m256i indices = _mm256_or_si256(_mm256_mulhi_epu16(
+                    _mm256_and_si256(block, _mm256_set1_epi32(0x0fc0fc00)),
+                    _mm256_set1_epi32(0x04000040)),
+                _mm256_mullo_epi16(
+                    _mm256_and_si256(block, _mm256_set1_epi32(0x003f03f0)),
+                    _mm256_set1_epi32(0x01000010)));
+        __m256i range = _mm256_or_si256(
+                _mm256_subs_epu8(indices, _mm256_set1_epi8(51)),
+                _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26),
+                        indices), _mm256_set1_epi8(13)));
+        _mm256_storeu_si256((__m256i *) (out + j), _mm256_add_epi8(indices,
+                    _mm256_shuffle_epi8(offsets, range)));
+    }
+    return i + encode_ssse3(out + j, in + i, length - i);
+}
+
+// The 12 bytes of each lane are packed together before the store
+__attribute__((target("avx2")))
+static size_t decode_avx2 (unsigned char *out, unsigned char const *in,
+        size_t length, size_t decoded)
+{
+    size_t i = 0, j = 0;
+    __m256i low_classes = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x15,
+                0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13,
+                0x1a, 0x1b, 0x1b, 0x1b, 0x1a));
+    __m256i high_classes = _mm256_broadcastsi128_si256(_mm_setr_epi8(0x10,
+                0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10,
+                0x10, 0x10, 0x10, 0x10, 0x10));
+    __m256i shifts = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, 16, 19, 4,
+                -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0));
+    __m256i order = _mm256_broadcastsi128_si256(_mm_setr_epi8(2, 1, 0, 6, 5,
+                4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    for (; length - i >= 36 && decoded - j >= 32; i += 32, j += 24) {
+        __m256i block = _mm256_loadu_si256((__m256i const *) (in + i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi32(block, 4),
+                _mm256_set1_epi8(0x0f));
+        __m256i low = _mm256_and_si256(block, _mm256_set1_epi8(0x0f));
+        __m256i valid = _mm256_cmpeq_epi8(_mm256_and_si256(
+                    _mm256_shuffle_epi8(low_classes, low),
+                    _mm256_shuffle_epi8(high_classes, high)),
+                _mm256_setzero_si256());
+        if ((uint32_t) _mm256_movemask_epi8(valid) != 0xffffffff) break;
+        __m256i slash = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/'));
+        block = _mm256_add_epi8(block, _mm256_shuffle_epi8(shifts,
+                    _mm256_add_epi8(slash, high)));
+        block = _mm256_maddubs_epi16(block, _mm256_set1_epi32(0x01400140));
+        block = _mm256_madd_epi16(block, _mm256_set1_epi32(0x00011000));
+        block = _mm256_shuffle_epi8(block, order);
+        block = _mm256_permutevar8x32_epi32(block,
+                _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        _mm256_storeu_si256((__m256i *) (out + j), block);
+    }
+    return i + decode_ssse3(out + j, in + i, length - i, decoded - j);
+}
+#endif
+
+// AVX2 kernels fall through to SSSE3 ones for what is too short for them
+static void pick_base64_kernels (void)
+{
+#ifdef X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        encode_blocks = encode_avx2;
+        decode_blocks = decode_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        encode_blocks = encode_ssse3;
+        decode_blocks = decode_ssse3;
+    }
+#endif
+}
+
+void encode_base64 (char *out, unsigned char const *in, size_t length)
+{
+    pthread_once(&base64_once, pick_base64_kernels);
+    size_t i = 0, j = 0;
+    if (encode_blocks) {
+        i = encode_blocks(out, in, length);
+        j = i / 3 * 4;
+    }
+    for (; length - i >= 3; i += 3, j += 4) {
+        uint32_t group = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out[j] = base64_alphabet[group >> 18];
+        out[j + 1] = base64_alphabet[group >> 12 & 0x3f];
+        out[j + 2] = base64_alphabet[group >> 6 & 0x3f];
+        out[j + 3] = base64_alphabet[group & 0x3f];
+    }
+    if (length > i) {
+        uint32_t group = in[i] << 16;
+        if (length - i == 2) group |= in[i + 1] << 8;
+        out[j] = base64_alphabet[group >> 18];
+        out[j + 1] = base64_alphabet[group >> 12 & 0x3f];
+        out[j + 2] = length - i == 2 ? base64_alphabet[group >> 6 & 0x3f] : '=';
+        out[j + 3] = '=';
         j += 4;
     }
-    // Null-terminate string
-    output[4 * ((length + 2) / 3)] = '\0';
-    return output;
-}
-
-unsigned char *base64_decode (char *in, size_t *length)
-{
-    size_t input_length = strlen(in);
-    assert(input_length % 4 == 0);
-    *length = 3 * input_length / 4;
-    if (in[input_length - 1] == '=') *length -= 1;
-    if (in[input_length - 2] == '=') *length -= 1;
-    unsigned char *output = malloc(*length * sizeof(unsigned char));
-    for (int i = 0, j = 0; i < input_length; i += 4){
-        int group = 0;
-        for (int k = 0; k < 4; k++){
-            int n = 0, c = (int) in[i + k];
-            if ('A' <= c && c <= 'Z') n = c - 'A';
-            else if ('a' <= c && c <= 'z') n = c - 'a' + 26;
-            else if ('0' <= c && c <= '9') n = c - '0' + 52;
-            else if (c == '+') n = 62;
-            else if (c == '/') n = 63;
-            else if (c == '=') break;
-            else assert(false);
-            group += n << (18 - k * 6);
-        }
-        for (int k = 0; k < 3 && k + j < *length; k++){
-            output[k + j] = 0xff & (group >> (16 - k * 8));
-        }
-        j += 3;
+    out[j] = '\0';
+}
+
+error decode_base64 (unsigned char *out, size_t *size, char const *in,
+        size_t length)
+{
+    if (length % 4) return error(DSP_E_INVALID, "Invalid base-64 length");
+    size_t decoded = length / 4 * 3;
+    if (length && in[length - 1] == '=') decoded--;
+    if (length && in[length - 2] == '=') decoded--;
+    if (decoded > *size)
+        return error(DSP_E_INVALID, "Base-64 output buffer too small");
+    unsigned char const *input = (unsigned char const *) in;
+    size_t i = 0, j = 0;
+    // The last group, which may be padded, is always decoded by the scalar
+    //  loop; the vector kernels store whole registers past what they decode,
+    //  and leave a block with an invalid character for it to report
+    pthread_once(&base64_once, pick_base64_kernels);
+    if (decode_blocks) {
+        i = decode_blocks(out, input, length, decoded);
+        j = i / 4 * 3;
+    }
+    unsigned char invalid = 0;
+    for (; length - i > 4; i += 4, j += 3) {
+        unsigned char a = base64_values[input[i]], b = base64_values[input[i + 1]],
+            c = base64_values[input[i + 2]], d = base64_values[input[i + 3]];
+        invalid |= a | b | c | d;
+        uint32_t group = a << 18 | b << 12 | c << 6 | d;
+        out[j] = group >> 16;
+        out[j + 1] = group >> 8;
+        out[j + 2] = group;
+    }
+    if (length) {
+        // Padding is only allowed in the last two places
+        unsigned char a = base64_values[input[i]],
+            b = base64_values[input[i + 1]],
+            c = input[i + 2] == '=' && input[i + 3] == '='
+                ? 0 : base64_values[input[i + 2]],
+            d = input[i + 3] == '=' ? 0 : base64_values[input[i + 3]];
+        invalid |= a | b | c | d;
+        uint32_t group = a << 18 | b << 12 | c << 6 | d;
+        out[j] = group >> 16;
+        if (decoded - j > 1) out[j + 1] = group >> 8;
+        if (decoded - j > 2) out[j + 2] = group;
     }
-    return output;
+    if (invalid & 0xc0) return error(DSP_E_INVALID, "Invalid base-64 character");
+    *size = decoded;
+    return NULL;
 }
 
 // Public-key crypto functions
 
-dsp_error new_keypair (unsigned char **public, unsigned char **private)
+dsp_error encrypt_keypair (unsigned char **public, unsigned char **private)
 {
     *public = malloc(PUBLIC_KEY_LENGTH);
     *private = malloc(PRIVATE_KEY_LENGTH);
     if (!*public || !*private) return sys_error(DSP_E_SYSTEM, errno,
             "Failed to allocate key-pair");
-    crypto_box_keypair(*private, *public);
+    crypto_box_keypair(*public, *private);
+    return NULL;
+}
+
+error keys_open (struct keys **keys)
+{
+    if (!(*keys = calloc(1, sizeof(struct keys))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate key cache");
+    pthread_mutex_init(&(*keys)->mutex, NULL);
+    return NULL;
+}
+
+void keys_close (struct keys *keys)
+{
+    pthread_mutex_destroy(&keys->mutex);
+    explicit_bzero(keys->entries, sizeof(keys->entries));
+    free(keys);
+}
+
+void precompute (unsigned char *key, unsigned char const *public_key,
+        unsigned char const *private_key)
+{
+    crypto_box_beforenm(key, public_key, private_key);
+}
+
+// The scalar multiplication is done outside the mutex; concurrent misses on
+//  the same node each compute the same key
+void shared_key (struct dsp *dsp, unsigned char const *peer,
+        unsigned char *key)
+{
+    struct keys *keys = dsp->keys;
+    uint32_t h;
+    memcpy(&h, peer, sizeof(uint32_t));
+    int i = h % KEY_CACHE_SIZE;
+    pthread_mutex_lock(&keys->mutex);
+    bool hit = keys->entries[i].used
+        && !memcmp(keys->entries[i].peer, peer, PUBLIC_KEY_LENGTH);
+    if (hit) memcpy(key, keys->entries[i].key, SHARED_KEY_LENGTH);
+    pthread_mutex_unlock(&keys->mutex);
+    if (hit) return;
+    precompute(key, peer, dsp->private_key);
+    pthread_mutex_lock(&keys->mutex);
+    keys->entries[i].used = true;
+    memcpy(keys->entries[i].peer, peer, PUBLIC_KEY_LENGTH);
+    memcpy(keys->entries[i].key, key, SHARED_KEY_LENGTH);
+    pthread_mutex_unlock(&keys->mutex);
+}
+
+// NaCl boxes take their input after crypto_box_ZEROBYTES of zeros, and give
+//  their output after crypto_box_BOXZEROBYTES of zeros.  The padding is
+//  handled here, so that callers deal in MAC and ciphertext only.
+
+void encrypt (unsigned char *out, unsigned char const *in, size_t length,
+        unsigned char const *nonce, unsigned char const *key)
+{
+    assert(length <= MAX_MESSAGE_LENGTH);
+    unsigned char m[crypto_box_ZEROBYTES + MAX_MESSAGE_LENGTH] = {0};
+    unsigned char c[crypto_box_ZEROBYTES + MAX_MESSAGE_LENGTH];
+    memcpy(m + crypto_box_ZEROBYTES, in, length);
+    crypto_box_afternm(c, m, crypto_box_ZEROBYTES + length, nonce, key);
+    memcpy(out, c + crypto_box_BOXZEROBYTES, MAC_LENGTH + length);
+}
+
+error decrypt (unsigned char *out, unsigned char const *in, size_t length,
+        unsigned char const *nonce, unsigned char const *key)
+{
+    if (length < MAC_LENGTH || length - MAC_LENGTH > MAX_MESSAGE_LENGTH)
+        return error(DSP_E_NODE_INVALID, "Invalid box length");
+    unsigned char c[crypto_box_ZEROBYTES + MAX_MESSAGE_LENGTH] = {0};
+    unsigned char m[crypto_box_ZEROBYTES + MAX_MESSAGE_LENGTH];
+    memcpy(c + crypto_box_BOXZEROBYTES, in, length);
+    if (crypto_box_open_afternm(m, c, crypto_box_BOXZEROBYTES + length, nonce,
+                key))
+        return error(DSP_E_NODE_INVALID, "Failed to open box");
+    memcpy(out, m + crypto_box_ZEROBYTES, length - MAC_LENGTH);
     return NULL;
 }
 
 // Secret-key crypto functions
 
+void seal (unsigned char *out, unsigned char const *in, size_t length,
+        unsigned char const *nonce, unsigned char const *key)
+{
+    assert(length <= MAX_MESSAGE_LENGTH);
+    unsigned char m[crypto_secretbox_ZEROBYTES + MAX_MESSAGE_LENGTH] = {0};
+    unsigned char c[crypto_secretbox_ZEROBYTES + MAX_MESSAGE_LENGTH];
+    memcpy(m + crypto_secretbox_ZEROBYTES, in, length);
+    crypto_secretbox(c, m, crypto_secretbox_ZEROBYTES + length, nonce, key);
+    memcpy(out, c + crypto_secretbox_BOXZEROBYTES, MAC_LENGTH + length);
+}
 
+error unseal (unsigned char *out, unsigned char const *in, size_t length,
+        unsigned char const *nonce, unsigned char const *key)
+{
+    if (length < MAC_LENGTH || length - MAC_LENGTH > MAX_MESSAGE_LENGTH)
+        return error(DSP_E_NODE_INVALID, "Invalid sealed length");
+    unsigned char c[crypto_secretbox_ZEROBYTES + MAX_MESSAGE_LENGTH] = {0};
+    unsigned char m[crypto_secretbox_ZEROBYTES + MAX_MESSAGE_LENGTH];
+    memcpy(c + crypto_secretbox_BOXZEROBYTES, in, length);
+    if (crypto_secretbox_open(m, c, crypto_secretbox_BOXZEROBYTES + length,
+                nonce, key))
+        return error(DSP_E_NODE_INVALID, "Failed to unseal message");
+    memcpy(out, m + crypto_secretbox_ZEROBYTES, length - MAC_LENGTH);
+    return NULL;
+}
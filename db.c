@@ -1,28 +1,79 @@
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sqlite3.h>
+#include <time.h>
 #include "dsp.h"
 
 #define DB_NAME "db"
+// Number of fingerprints looked up by one execution of a batched select
+#define SELECT_BATCH 32
 
 enum {
     SELECT_NODE,
-    INSERT_NODE,
-    UPDATE_NODE_ADDRESS,
+    UPSERT_NODE,
+    BEGIN,
+    COMMIT,
+    ROLLBACK,
     NUM_OF_STMTS
 };
 
-struct db {
+// Each thread reading the database opens a read-only connection of its own on
+//  first use, kept until the thread exits or the database is closed.
+struct reader {
+    struct reader *next;
+    struct db *db;
+    pthread_t owner;
     sqlite3 *conn;
+    sqlite3_stmt *select;
+    sqlite3_stmt *select_batch;
+};
+
+// Rows queued for the writer, indexed by fingerprint in an open-addressed
+//  table of <num_slots>.  A fingerprint queued again overwrites its row, so
+//  that it is written once per batch.
+struct queue {
+    struct node *rows;
+    int count;
+    int *slots;                     // row number plus one, or 0 if empty
+};
+
+// Writes are queued on <pending>, and committed by the writer thread in a
+//  single transaction.  The writer swaps the queue for its spare one, so that
+//  writes are queued while it commits; until the commit is done, the rows it
+//  holds are still searched by select_node.  Writes from the I/O threads
+//  never wait for a full queue: the routing table in memory is authoritative,
+//  and a node that misses a batch is written again when it next changes.
+struct db {
+    sqlite3 *conn;                  // used by the writer thread only
     sqlite3_stmt *statement[NUM_OF_STMTS];
+    char *path;
+    pthread_key_t reader;
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;          // signalled on the first and last rows
+    pthread_cond_t committed;       // signalled when a full queue is swapped
+    struct queue pending;
+    struct queue writing;
+    size_t num_slots;
+    int dropped;                    // writes dropped since the last swap
+    bool stopping;
+    pthread_t writer;
 };
 
+// Readers of every database.  A thread exiting and db_close may both go to
+//  free the same reader, and whichever comes second no longer finds it here.
+static pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct reader *readers;
+
 char *sql[] = {
-    "SELECT public_key, address FROM node WHERE fingerprint = ?",
-    "INSERT INTO node VALUES (?, ?, ?)",
-    "UPDATE node SET address = ?"
+    "SELECT fingerprint, public_key, address FROM node WHERE fingerprint = ?",
+    "INSERT OR REPLACE INTO node VALUES (?, ?, ?)",
+    "BEGIN",
+    "COMMIT",
+    "ROLLBACK"
 };
 
 char const * const schema =
@@ -68,9 +119,26 @@ static dsp_error validate_schema (struct db *db)
     return NULL;
 }
 
+// Committing a transaction in WAL mode appends to the log without waiting on
+//  the readers, and with synchronous=NORMAL only checkpoints wait on fsync
+static dsp_error set_journal (struct db *db)
+{
+    char *err_msg;
+    int ret = sqlite3_exec(db->conn,
+            "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL",
+            NULL, NULL, &err_msg);
+    if (ret) {
+        dsp_error err = db_error(ret, err_msg);
+        sqlite3_free(err_msg);
+        return err;
+    }
+    return NULL;
+}
+
+// Selects run on the readers' connections
 static dsp_error prepare_statements (struct db *db)
 {
-    for (int i = 0; i < NUM_OF_STMTS; i++) {
+    for (int i = SELECT_NODE + 1; i < NUM_OF_STMTS; i++) {
         int ret = sqlite3_prepare_v2(db->conn, sql[i], -1, &db->statement[i],
                 NULL);
         if (ret) return db_error(ret, "Failed to initialize SQL statement");
@@ -80,95 +148,466 @@ static dsp_error prepare_statements (struct db *db)
     return NULL;
 }
 
+static dsp_error reset_stmt (sqlite3_stmt *statement)
+{
+    sqlite3_clear_bindings(statement);
+    int ret = sqlite3_reset(statement);
+    if (ret) return db_error(ret, "Failed to reset SQL statment");
+    return NULL;
+}
+
+// The batched select takes SELECT_BATCH fingerprints, of which those left
+//  unbound are NULL and match no row
+static void batch_sql (char *query)
+{
+    strcpy(query, "SELECT fingerprint, public_key, address FROM node "
+            "WHERE fingerprint IN (?");
+    for (int i = 1; i < SELECT_BATCH; i++) strcat(query, ", ?");
+    strcat(query, ")");
+}
+
+static void free_reader (struct reader *reader)
+{
+    sqlite3_finalize(reader->select_batch);
+    sqlite3_finalize(reader->select);
+    sqlite3_close(reader->conn);
+    free(reader);
+}
+
+// Called on the exit of a thread holding a reader.  <arg> is not read before
+//  it is found among the readers, as db_close may have freed it, and its
+//  memory been reused by another thread's reader.
+static void close_reader (void *arg)
+{
+    pthread_mutex_lock(&readers_mutex);
+    struct reader **p = &readers;
+    while (*p && (*p != arg || !pthread_equal((*p)->owner, pthread_self())))
+        p = &(*p)->next;
+    struct reader *reader = *p;
+    if (reader) *p = reader->next;
+    pthread_mutex_unlock(&readers_mutex);
+    if (reader) free_reader(reader);
+}
+
+static dsp_error get_reader (struct db *db, struct reader **reader)
+{
+    if (*reader = pthread_getspecific(db->reader)) return NULL;
+    if (!(*reader = calloc(1, sizeof(struct reader))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate reader");
+    (*reader)->db = db;
+    (*reader)->owner = pthread_self();
+    // The connection is never shared, and needs none of SQLite's locking
+    int ret = sqlite3_open_v2(db->path, &(*reader)->conn,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+    if (!ret) ret = sqlite3_prepare_v2((*reader)->conn, sql[SELECT_NODE], -1,
+            &(*reader)->select, NULL);
+    char query[128 + 3 * SELECT_BATCH];
+    batch_sql(query);
+    if (!ret) ret = sqlite3_prepare_v2((*reader)->conn, query, -1,
+            &(*reader)->select_batch, NULL);
+    if (!ret) ret = pthread_setspecific(db->reader, *reader);
+    if (ret) {
+        // Connection errors are SQLite's, and setspecific's are errno values
+        dsp_error err = (*reader)->select_batch
+            ? sys_error(DSP_E_SYSTEM, ret, "Failed to register reader")
+            : db_error(ret, "Failed to open reader");
+        free_reader(*reader);
+        *reader = NULL;
+        return err;
+    }
+    pthread_mutex_lock(&readers_mutex);
+    (*reader)->next = readers;
+    readers = *reader;
+    pthread_mutex_unlock(&readers_mutex);
+    return NULL;
+}
+
+static dsp_error step (struct db *db, int i)
+{
+    int ret = sqlite3_step(db->statement[i]);
+    sqlite3_reset(db->statement[i]);
+    if (ret != SQLITE_DONE) return db_error(ret, NULL);
+    return NULL;
+}
+
+static dsp_error upsert (struct db *db, struct node *node)
+{
+    sqlite3_stmt *statement = db->statement[UPSERT_NODE];
+    int ret;
+    if ((ret = sqlite3_bind_blob(statement, 1, node->fingerprint, HASH_LENGTH,
+                    SQLITE_STATIC))
+            || (ret = sqlite3_bind_blob(statement, 2, node->public_key,
+                    PUBLIC_KEY_LENGTH, SQLITE_STATIC))
+            || (ret = sqlite3_bind_text(statement, 3, node->address, -1,
+                    SQLITE_STATIC))) {
+        sqlite3_clear_bindings(statement);
+        return db_error(ret, NULL);
+    }
+    dsp_error err = step(db, UPSERT_NODE);
+    sqlite3_clear_bindings(statement);
+    return err;
+}
+
+// Returns false if the batch was rolled back because another connection
+//  held the database locked, and should be tried again.  Any other failure is
+//  logged and the batch dropped: its nodes stay in the routing table, but are
+//  not stored until they are next updated.
+static bool commit (struct db *db, struct node *nodes, int n)
+{
+    dsp_error err = step(db, BEGIN);
+    for (int i = 0; !err && i < n; i++) err = upsert(db, &nodes[i]);
+    if (!err) err = step(db, COMMIT);
+    if (!err) return true;
+    // The failed statement's code, before the rollback replaces it
+    int ret = sqlite3_errcode(db->conn);
+    dsp_error rollback = step(db, ROLLBACK);
+    if (rollback) dsp_error_free(rollback);
+    if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED) {
+        dsp_error_free(err);
+        return false;
+    }
+    log_error(err);
+    dsp_error_free(err);
+    return true;
+}
+
+static void after_interval (struct timespec *deadline)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_nsec += DB_COMMIT_INTERVAL % 1000 * 1000000L;
+    deadline->tv_sec += DB_COMMIT_INTERVAL / 1000
+        + deadline->tv_nsec / 1000000000L;
+    deadline->tv_nsec %= 1000000000L;
+}
+
+static void *write_behind (void *arg)
+{
+    struct db *db = arg;
+    pthread_mutex_lock(&db->mutex);
+    while (1) {
+        while (!db->pending.count && !db->stopping)
+            pthread_cond_wait(&db->queued, &db->mutex);
+        if (!db->pending.count) break;
+        // Rows queued within the interval join the batch
+        struct timespec deadline;
+        after_interval(&deadline);
+        while (db->pending.count < DB_COMMIT_ROWS && !db->stopping
+                && pthread_cond_timedwait(&db->queued, &db->mutex, &deadline)
+                != ETIMEDOUT);
+        struct queue batch = db->pending;
+        db->pending = db->writing;
+        db->writing = batch;
+        pthread_cond_broadcast(&db->committed);
+        int dropped = db->dropped;
+        db->dropped = 0;
+        pthread_mutex_unlock(&db->mutex);
+        if (dropped) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Write queue full, dropped %d nodes",
+                    dropped);
+            dsp_error err = error(DSP_E_DATABASE, msg);
+            log_error(err);
+            dsp_error_free(err);
+        }
+        // Once <pending> fills meanwhile, writes are dropped until the retries
+        //  are done, and store_node waits for them
+        for (int tries = 1; !commit(db, batch.rows, batch.count); tries++) {
+            if (tries == DB_COMMIT_TRIES) {
+                dsp_error err = error(DSP_E_DATABASE,
+                        "Database locked, dropped a batch of writes");
+                log_error(err);
+                dsp_error_free(err);
+                break;
+            }
+            after_interval(&deadline);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                        NULL) == EINTR);
+        }
+        pthread_mutex_lock(&db->mutex);
+        memset(db->writing.slots, 0, db->num_slots * sizeof(int));
+        db->writing.count = 0;
+    }
+    pthread_mutex_unlock(&db->mutex);
+    return NULL;
+}
+
+// Returns the slot of <fingerprint> in <queue>, or the empty slot where it
+//  belongs.  Fingerprints are hashes already, and their trailing word is used
+//  as is.
+static int *find_slot (struct db *db, struct queue *queue,
+        unsigned char const *fingerprint)
+{
+    uint64_t word;
+    memcpy(&word, fingerprint + HASH_LENGTH - sizeof(uint64_t),
+            sizeof(uint64_t));
+    size_t i = word & (db->num_slots - 1);
+    while (queue->slots[i] && memcmp(queue->rows[queue->slots[i] - 1]
+                .fingerprint, fingerprint, HASH_LENGTH))
+        i = (i + 1) & (db->num_slots - 1);
+    return &queue->slots[i];
+}
+
+// Returns the latest queued write of <fingerprint>, if any
+static struct node *find_queued (struct db *db,
+        unsigned char const *fingerprint)
+{
+    int *slot = find_slot(db, &db->pending, fingerprint);
+    if (*slot) return &db->pending.rows[*slot - 1];
+    slot = find_slot(db, &db->writing, fingerprint);
+    if (*slot) return &db->writing.rows[*slot - 1];
+    return NULL;
+}
+
+// Queues <node>, replacing its queued write if any.  With the queue full, it
+//  waits for the writer to swap it if <wait>, and drops the write otherwise.
+static dsp_error queue_node (struct db *db, struct node *node, bool wait)
+{
+    pthread_mutex_lock(&db->mutex);
+    int *slot;
+    while (!*(slot = find_slot(db, &db->pending, node->fingerprint))
+            && db->pending.count == DB_COMMIT_ROWS) {
+        if (!wait) {
+            db->dropped++;
+            pthread_mutex_unlock(&db->mutex);
+            return NULL;
+        }
+        pthread_cond_wait(&db->committed, &db->mutex);
+    }
+    if (*slot) {
+        db->pending.rows[*slot - 1] = *node;
+    } else {
+        db->pending.rows[db->pending.count] = *node;
+        *slot = ++db->pending.count;
+        if (db->pending.count == 1 || db->pending.count == DB_COMMIT_ROWS)
+            pthread_cond_signal(&db->queued);
+    }
+    pthread_mutex_unlock(&db->mutex);
+    return NULL;
+}
+
+static dsp_error open_queue (struct db *db, struct queue *queue)
+{
+    if (!(queue->rows = malloc(DB_COMMIT_ROWS * sizeof(struct node)))
+            || !(queue->slots = calloc(db->num_slots, sizeof(int))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate write queue");
+    return NULL;
+}
+
 dsp_error db_open (struct db **db) {
     int ret;
     dsp_error err;
-    if (!(*db = malloc(sizeof(struct db))))
+    if (!(*db = calloc(1, sizeof(struct db))))
         return sys_error(DSP_E_SYSTEM, errno, NULL);
+    // The queues' tables are kept at most half full
+    for ((*db)->num_slots = 1; (*db)->num_slots < 2 * DB_COMMIT_ROWS;
+            (*db)->num_slots <<= 1);
+    if ((err = open_queue(*db, &(*db)->pending))
+            || (err = open_queue(*db, &(*db)->writing)))
+        return err;
     if (ret = sqlite3_open(DB_NAME, &(*db)->conn))
         return db_error(ret, "Failed to open database");
+    if (err = set_journal(*db)) return err;
     if (err = validate_schema(*db)) return err;
     if (err = prepare_statements(*db)) return err;
+    // Readers may be opened from another working directory
+    if (!((*db)->path = strdup(sqlite3_db_filename((*db)->conn, "main"))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate path");
+    if (ret = pthread_key_create(&(*db)->reader, close_reader))
+        return sys_error(DSP_E_SYSTEM, ret, "Failed to create reader key");
+    pthread_mutex_init(&(*db)->mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(*db)->queued, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&(*db)->committed, NULL);
+    if (ret = pthread_create(&(*db)->writer, NULL, write_behind, *db))
+        return sys_error(DSP_E_SYSTEM, ret, "Failed to create database writer");
     return NULL;
 }
 
+// Queued writes are committed before closing.  Readers still held by running
+//  threads are closed as well, and those threads must not use the database
+//  again.
 dsp_error db_close (struct db *db) {
     assert(db && db->conn);
     int ret;
-    for (int i; i < NUM_OF_STMTS; i++) {
+    pthread_mutex_lock(&db->mutex);
+    db->stopping = true;
+    pthread_cond_signal(&db->queued);
+    pthread_mutex_unlock(&db->mutex);
+    pthread_join(db->writer, NULL);
+    // Once the key is deleted, no thread exit calls close_reader for it; one
+    //  already in close_reader waits here, and then finds its reader gone
+    pthread_mutex_lock(&readers_mutex);
+    pthread_key_delete(db->reader);
+    struct reader **p = &readers;
+    while (*p) {
+        struct reader *reader = *p;
+        if (reader->db != db) {
+            p = &reader->next;
+            continue;
+        }
+        *p = reader->next;
+        free_reader(reader);
+    }
+    pthread_mutex_unlock(&readers_mutex);
+    for (int i = 0; i < NUM_OF_STMTS; i++) {
         if (ret = sqlite3_finalize(db->statement[i]))
             return db_error(ret, "Failed to finalize SQL statement");
     }
     if (ret = sqlite3_close(db->conn))
         return db_error(ret, "Failed to close database");
+    pthread_cond_destroy(&db->committed);
+    pthread_cond_destroy(&db->queued);
+    pthread_mutex_destroy(&db->mutex);
+    free(db->path);
+    free(db->pending.rows);
+    free(db->pending.slots);
+    free(db->writing.rows);
+    free(db->writing.slots);
     free(db);
     return NULL;
 }
 
-static dsp_error reset_stmt (struct db *db, int i)
+// Reads the fingerprint, public key and address of the current row
+static dsp_error read_columns (sqlite3_stmt *statement, struct node *node)
 {
-    sqlite3_clear_bindings(db->statement[i]);
-    int ret = sqlite3_reset(db->statement[i]);
-    if (ret) return db_error(ret, "Failed to reset SQL statment");
+    void const *fingerprint = sqlite3_column_blob(statement, 0);
+    if (sqlite3_column_bytes(statement, 0) != HASH_LENGTH)
+        return error(DSP_E_NODE_INVALID, "Invalid fingerprint");
+    void const *key = sqlite3_column_blob(statement, 1);
+    if (sqlite3_column_bytes(statement, 1) != PUBLIC_KEY_LENGTH)
+        return error(DSP_E_NODE_INVALID, "Invalid public key");
+    char const *address = (char const *) sqlite3_column_text(statement, 2);
+    int length = sqlite3_column_bytes(statement, 2);
+    if (length >= ADDRESS_LENGTH)
+        return error(DSP_E_NODE_INVALID, "Invalid address");
+    memset(node, 0, sizeof(struct node));
+    memcpy(node->fingerprint, fingerprint, HASH_LENGTH);
+    memcpy(node->public_key, key, PUBLIC_KEY_LENGTH);
+    memcpy(node->address, address, length);
     return NULL;
 }
 
-dsp_error select_node (struct db *db, unsigned char *fingerprint, struct node **node)
+// Reads the row of <fingerprint> into a new node, or leaves <*node> unset if
+//  there is none
+static dsp_error read_row (sqlite3_stmt *statement, unsigned char *fingerprint,
+        struct node **node)
 {
     // Bind fingerprint to where clause
-    int ret = sqlite3_bind_blob(db->statement[SELECT_NODE], 1, fingerprint, HASH_LENGTH, SQLITE_STATIC);
+    int ret = sqlite3_bind_blob(statement, 1, fingerprint, HASH_LENGTH,
+            SQLITE_STATIC);
     if (ret) return db_error(ret, NULL);
     // Select row
-    ret = sqlite3_step(db->statement[SELECT_NODE]);
-    if (ret != SQLITE_ROW) {
-        if (ret == SQLITE_DONE) {
-            *node = NULL;
-            return NULL;
-        }
-        return db_error(ret, NULL);
-    }
-    // Allocate node
-    *node = calloc(1, sizeof(struct node));
-    if (!*node) return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node");
-    // Set fingerprint
-    memcpy((*node)->fingerprint, fingerprint, HASH_LENGTH);
-    // Retrieve public key blob
-    void const *res = sqlite3_column_blob(db->statement[SELECT_NODE], 0);
-    int n = sqlite3_column_bytes(db->statement[SELECT_NODE], 0);
-    if (n != PUBLIC_KEY_LENGTH) return error(DSP_E_NODE_INVALID, "Invalid public key");
-    memcpy((*node)->public_key, res, PUBLIC_KEY_LENGTH);
-    // Retrieve address string 
-    res = sqlite3_column_text(db->statement[SELECT_NODE], 1);
-    n = sqlite3_column_bytes(db->statement[SELECT_NODE], 1);
-    strncpy((*node)->address, res, n + 1);
-    assert(strlen(res) == n);
-    // Reset statement
-    dsp_error err = reset_stmt(db, SELECT_NODE);
+    ret = sqlite3_step(statement);
+    if (ret == SQLITE_DONE) return NULL;
+    if (ret != SQLITE_ROW) return db_error(ret, NULL);
+    struct node row;
+    dsp_error err = read_columns(statement, &row);
     if (err) return err;
+    if (!(*node = malloc(sizeof(struct node))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node");
+    **node = row;
     return NULL;
 }
 
-dsp_error insert_node (struct db *db, struct node *node)
+// Runs the batched select on the <m> fingerprints of <indices>
+static dsp_error read_batch (sqlite3_stmt *statement,
+        unsigned char const (*fingerprints)[HASH_LENGTH], int const *indices,
+        int m, struct node *nodes, bool *found)
 {
-    // Bind fingerprint
-    int ret = sqlite3_bind_blob(db->statement[INSERT_NODE], 1, node->fingerprint, HASH_LENGTH, SQLITE_STATIC);
-    if (ret) return db_error(ret, NULL);
-    // Bind public_key
-    ret = sqlite3_bind_blob(db->statement[INSERT_NODE], 2, node->public_key, PUBLIC_KEY_LENGTH, SQLITE_STATIC);
+    int ret = 0;
+    for (int j = 0; !ret && j < m; j++)
+        ret = sqlite3_bind_blob(statement, j + 1, fingerprints[indices[j]],
+                HASH_LENGTH, SQLITE_STATIC);
     if (ret) return db_error(ret, NULL);
-    // Bind address
-    ret = sqlite3_bind_text(db->statement[INSERT_NODE], 3, node->address, -1, SQLITE_STATIC);
-    if (ret) return db_error(ret, NULL);
-    // Perform insert
-    ret = sqlite3_step(db->statement[SELECT_NODE]);
+    struct node row;
+    while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+        dsp_error err = read_columns(statement, &row);
+        if (err) return err;
+        // A fingerprint asked for more than once is filled in each time
+        for (int j = 0; j < m; j++) {
+            if (!memcmp(fingerprints[indices[j]], row.fingerprint,
+                        HASH_LENGTH)) {
+                nodes[indices[j]] = row;
+                found[indices[j]] = true;
+            }
+        }
+    }
     if (ret != SQLITE_DONE) return db_error(ret, NULL);
-    // Reset statement
-    dsp_error err = reset_stmt(db, INSERT_NODE);
-    if (err) return err;
     return NULL;
 }
 
+dsp_error select_node (struct db *db, unsigned char *fingerprint, struct node **node)
+{
+    *node = NULL;
+    pthread_mutex_lock(&db->mutex);
+    struct node *queued = find_queued(db, fingerprint);
+    if (queued && (*node = malloc(sizeof(struct node)))) **node = *queued;
+    pthread_mutex_unlock(&db->mutex);
+    if (queued) {
+        if (!*node)
+            return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node");
+        return NULL;
+    }
+    struct reader *reader;
+    dsp_error err = get_reader(db, &reader);
+    if (err) return err;
+    err = read_row(reader->select, fingerprint, node);
+    dsp_error reset = reset_stmt(reader->select);
+    if (reset && err) dsp_error_free(reset);
+    else if (reset) err = reset;
+    if (err && *node) {
+        free(*node);
+        *node = NULL;
+    }
+    return err;
+}
+
+dsp_error select_nodes (struct db *db,
+        unsigned char const (*fingerprints)[HASH_LENGTH], int n,
+        struct node *nodes, bool *found)
+{
+    memset(found, 0, n * sizeof(bool));
+    pthread_mutex_lock(&db->mutex);
+    for (int i = 0; i < n; i++) {
+        struct node *queued = find_queued(db, fingerprints[i]);
+        if (queued) {
+            nodes[i] = *queued;
+            found[i] = true;
+        }
+    }
+    pthread_mutex_unlock(&db->mutex);
+    struct reader *reader;
+    dsp_error err = get_reader(db, &reader);
+    if (err) return err;
+    int indices[SELECT_BATCH];
+    for (int i = 0; !err && i < n;) {
+        int m = 0;
+        for (; i < n && m < SELECT_BATCH; i++)
+            if (!found[i]) indices[m++] = i;
+        if (!m) break;
+        err = read_batch(reader->select_batch, fingerprints, indices, m,
+                nodes, found);
+        dsp_error reset = reset_stmt(reader->select_batch);
+        if (reset && err) dsp_error_free(reset);
+        else if (reset) err = reset;
+    }
+    return err;
+}
+
+dsp_error insert_node (struct db *db, struct node *node)
+{
+    return queue_node(db, node, false);
+}
+
 dsp_error update_node (struct db *db, struct node *node)
 {
-    return NULL;
+    return queue_node(db, node, false);
+}
+
+dsp_error store_node (struct db *db, struct node *node)
+{
+    return queue_node(db, node, true);
 }
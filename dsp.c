@@ -1,11 +1,25 @@
 #include <errno.h>
+#include <nacl/randombytes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
 #include "dsp.h"
 
+// Runs a listener thread, which only returns on failure
+static void *run_listener (void *arg)
+{
+    struct listener *listener = arg;
+    error err = net_listen(listener->dsp, listener->socket);
+    if (err) {
+        log_error(err);
+        dsp_error_free(err);
+    }
+    return NULL;
+}
+
 error dsp_init (char const *path, struct dsp **dsp)
 {
     error err;
@@ -28,17 +42,107 @@ error dsp_init (char const *path, struct dsp **dsp)
         log_error(err);
         return err;
     }
-    int ret = pthread_create(&(*dsp)->listener, NULL,
-            (void * (*)(void *)) net_listen, *dsp);
-    if (ret) return sys_error(DSP_E_SYSTEM, ret, "Failed to create listener");
+    // Keys are not stored yet, and the node takes a new identity on each start
+    if (err = encrypt_keypair(&(*dsp)->public_key, &(*dsp)->private_key)) {
+        log_error(err);
+        return err;
+    }
+    fingerprint((*dsp)->public_key, (*dsp)->fingerprint);
+    if (err = nodes_open(&(*dsp)->nodes)) {
+        log_error(err);
+        return err;
+    }
+    if (err = cache_open(&(*dsp)->cache, CACHE_SIZE)) {
+        log_error(err);
+        return err;
+    }
+    if ((err = flights_open(&(*dsp)->lookups))
+            || (err = flights_open(&(*dsp)->connects))) {
+        log_error(err);
+        return err;
+    }
+    if (err = hedging_open(&(*dsp)->hedging)) {
+        log_error(err);
+        return err;
+    }
+    if (err = keys_open(&(*dsp)->keys)) {
+        log_error(err);
+        return err;
+    }
+    if (err = sessions_open(&(*dsp)->sessions)) {
+        log_error(err);
+        return err;
+    }
+    // Tickets issued before a restart are refused, and sessions start over
+    randombytes((*dsp)->ticket_key, SESSION_KEY_LENGTH);
+    if (err = pool_open(&(*dsp)->pool, POOL_SIZE)) {
+        log_error(err);
+        return err;
+    }
+    if (err = io_open(&(*dsp)->io, IO_THREADS)) {
+        log_error(err);
+        return err;
+    }
+    if (err = offload_open(&(*dsp)->offload, CRYPTO_THREADS)) {
+        log_error(err);
+        return err;
+    }
+    // Inbound connections are sharded by the kernel across one listener
+    //  socket per thread.  Every socket is bound before any thread starts, so
+    //  that all share the port taken by the first.
+    int n = LISTENER_THREADS;
+    if (n <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? cpus : 1;
+    }
+    if (!((*dsp)->listeners = calloc(n, sizeof(struct listener)))) {
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to allocate listeners");
+        log_error(err);
+        return err;
+    }
+    (*dsp)->tcp_port = TCP_PORT;
+    for (int i = 0; i < n; i++) {
+        (*dsp)->listeners[i].dsp = *dsp;
+        if (err = net_bind(*dsp, &(*dsp)->listeners[i].socket)) {
+            while (i--) close((*dsp)->listeners[i].socket);
+            log_error(err);
+            return err;
+        }
+    }
+    for (; (*dsp)->num_listeners < n; (*dsp)->num_listeners++) {
+        struct listener *listener = &(*dsp)->listeners[(*dsp)->num_listeners];
+        int ret = pthread_create(&listener->thread, NULL, run_listener,
+                listener);
+        if (ret) {
+            for (int i = (*dsp)->num_listeners; i < n; i++)
+                close((*dsp)->listeners[i].socket);
+            err = sys_error(DSP_E_SYSTEM, ret, "Failed to create listener");
+            log_error(err);
+            return err;
+        }
+    }
     return NULL;
 }
 
 error dsp_close (struct dsp *dsp)
 {
     //TODO: cancel threads
+    pool_close(dsp->pool);
+    io_close(dsp->io);
+    offload_close(dsp->offload);
+    sessions_close(dsp->sessions);
+    keys_close(dsp->keys);
+    hedging_close(dsp->hedging);
+    flights_close(dsp->connects);
+    flights_close(dsp->lookups);
+    cache_close(dsp->cache);
+    nodes_close(dsp->nodes);
     error err = db_close(dsp->db);
     if (err) return err;
+    free(dsp->listeners);
+    explicit_bzero(dsp->private_key, PRIVATE_KEY_LENGTH);
+    free(dsp->private_key);
+    free(dsp->public_key);
     free(dsp);
     return NULL;
 }
@@ -1,54 +1,401 @@
 #ifndef DSP_H
 #define DSP_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define _POSIX_C_SOURCE 200809L 
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "libdsp.h"
 
 #define HASH_LENGTH DSP_HASH_LENGTH
+// One bucket per bit of the fingerprint; a node at distance d (see
+//  hash_distance) is kept in bucket d - 1.
+#define NUM_BUCKETS (8 * HASH_LENGTH)
+// Maximum number of nodes per bucket
+#ifndef BUCKET_SIZE
+#define BUCKET_SIZE 20
+#endif
+#define PUBLIC_KEY_LENGTH 32
+#define PRIVATE_KEY_LENGTH 32
+#define SHARED_KEY_LENGTH 32
+// Length of <n> bytes in padded base-64, without the terminating null
+#define BASE64_LENGTH(n) (4 * (((n) + 2) / 3))
+// Maximum length of a <host>:<port> address, including the terminating null
+#define ADDRESS_LENGTH 256
+
+// Number of listener threads, each with its own SO_REUSEPORT socket and event
+//  loop.  0 starts one listener per online processor.
+#ifndef LISTENER_THREADS
+#define LISTENER_THREADS 0
+#endif
+// Port the listeners accept connections on.  0 binds the first listener to a
+//  port of the system's choosing, which the others then share.
+#ifndef TCP_PORT
+#define TCP_PORT 0
+#endif
+
+// Maximum number of outgoing connections kept open; idle connections beyond it
+//  are closed in least-recently-used order.
+#ifndef POOL_SIZE
+#define POOL_SIZE 64
+#endif
+
+// Number of threads serving outgoing connections, each with its own event loop
+#ifndef IO_THREADS
+#define IO_THREADS 4
+#endif
+
+// Number of threads running public-key crypto off the event loops.  0 starts
+//  one per online processor.
+#ifndef CRYPTO_THREADS
+#define CRYPTO_THREADS 0
+#endif
+// Maximum number of jobs a crypto thread takes from the queue at once
+#ifndef OFFLOAD_BATCH
+#define OFFLOAD_BATCH 16
+#endif
+
+// Node store writes are queued and committed together, once the oldest has
+//  waited DB_COMMIT_INTERVAL milliseconds or DB_COMMIT_ROWS are queued
+#ifndef DB_COMMIT_INTERVAL
+#define DB_COMMIT_INTERVAL 100
+#endif
+#ifndef DB_COMMIT_ROWS
+#define DB_COMMIT_ROWS 1024
+#endif
+// Number of times a batch is tried, DB_COMMIT_INTERVAL apart, while another
+//  connection holds the database locked
+#ifndef DB_COMMIT_TRIES
+#define DB_COMMIT_TRIES 50
+#endif
+
+// Number of queries a lookup keeps in flight
+#ifndef LOOKUP_ALPHA
+#define LOOKUP_ALPHA 3
+#endif
+// Number of closest nodes that must answer before a lookup ends
+#ifndef LOOKUP_K
+#define LOOKUP_K BUCKET_SIZE
+#endif
+// Weight of the latest sample in a node's smoothed round trip, as 1/RTT_GAIN,
+//  and in the mean deviation of its round trips, as 1/RTT_DEVIATION_GAIN
+#ifndef RTT_GAIN
+#define RTT_GAIN 8
+#endif
+#ifndef RTT_DEVIATION_GAIN
+#define RTT_DEVIATION_GAIN 4
+#endif
+// Seconds to wait on a response before the request fails
+#ifndef REQUEST_TIMEOUT
+#define REQUEST_TIMEOUT 5
+#endif
+// A query to a node whose round trip has been measured is hedged once it has
+//  been outstanding for the smoothed round trip plus HEDGE_DEVIATIONS mean
+//  deviations.  Other queries are hedged after HEDGE_PERCENTILE percent of
+//  recent query round trips, or HEDGE_DELAY milliseconds until enough round
+//  trips have been seen.
+#ifndef HEDGE_DEVIATIONS
+#define HEDGE_DEVIATIONS 4
+#endif
+#ifndef HEDGE_PERCENTILE
+#define HEDGE_PERCENTILE 90
+#endif
+#ifndef HEDGE_DELAY
+#define HEDGE_DELAY 500
+#endif
+
+// Memory used by the lookup cache, in bytes
+#ifndef CACHE_SIZE
+#define CACHE_SIZE (1 << 20)
+#endif
+// Seconds for which a lookup result, or the absence of one, is cached
+#ifndef CACHE_TTL
+#define CACHE_TTL 300
+#endif
+#ifndef CACHE_NEGATIVE_TTL
+#define CACHE_NEGATIVE_TTL 30
+#endif
+
+// Keys of concurrent operations that are run once for all callers: a peer's
+//  public key and address, and fingerprints
+#define MAX_FLIGHT_KEY_LENGTH (PUBLIC_KEY_LENGTH + ADDRESS_LENGTH)
+
+// Maximum length of a message, excluding its frame header
+#define MAX_MESSAGE_LENGTH 4096
+// Messages are framed by a 4-byte length in network order
+#define FRAME_HEADER_LENGTH 4
+
+// Sessions.  After the handshake, messages are sealed with the session key in
+//  frames of their own, at a cost of 1 + MAC_LENGTH bytes.
+#define SESSION_KEY_LENGTH 32
+#define NONCE_LENGTH 24
+#define MAC_LENGTH 16
+// Prefix of the nonces of a connection in one direction.  The client chooses
+//  its own; the server uses the client's after a full handshake, and chooses
+//  a new one for each resumption.
+#define CONNECTION_ID_LENGTH 16
+// A ticket is the session key, the client's public key and the ticket's
+//  expiry, sealed with a key known only to the server
+#define TICKET_LENGTH (NONCE_LENGTH + MAC_LENGTH + SESSION_KEY_LENGTH \
+        + PUBLIC_KEY_LENGTH + 8)
+// Seconds for which a session may be resumed on a new connection
+#ifndef SESSION_TTL
+#define SESSION_TTL 3600
+#endif
+// Number of peers whose session tickets are kept
+#ifndef SESSION_CACHE_SIZE
+#define SESSION_CACHE_SIZE 1024
+#endif
+// Number of nodes whose shared keys are kept
+#ifndef KEY_CACHE_SIZE
+#define KEY_CACHE_SIZE 1024
+#endif
+// Maximum length of a frame: a sealed message carrying a ticket
+#define MAX_FRAME_LENGTH (1 + CONNECTION_ID_LENGTH + TICKET_LENGTH \
+        + MAC_LENGTH + MAX_MESSAGE_LENGTH)
+
+// Size of the Bloom filter of already-known nodes sent with each find
+//  request, and the number of bits set per node.  With n nodes in the filter,
+//  the false-positive rate is about (1 - e^(-BLOOM_HASHES * n / BLOOM_BITS))
+//  ^ BLOOM_HASHES; the defaults give under 0.1% for the 80 candidates of a
+//  lookup.
+#ifndef BLOOM_BITS
+#define BLOOM_BITS 2048
+#endif
+#ifndef BLOOM_HASHES
+#define BLOOM_HASHES 4
+#endif
+#define BLOOM_LENGTH (BLOOM_BITS / 8)
+
+// Message types
+enum {
+    MSG_FIND = 1,
+    MSG_FOUND,
+    // Frame types
+    MSG_HELLO,
+    MSG_WELCOME,
+    MSG_RESUME,
+    MSG_REJECT,
+    MSG_SEALED,
+    MSG_RESUMED
+};
+#define MSG_FIND_LENGTH (1 + HASH_LENGTH + BLOOM_LENGTH)
+#define MSG_HELLO_LENGTH (1 + PUBLIC_KEY_LENGTH + CONNECTION_ID_LENGTH \
+        + NONCE_LENGTH + MAC_LENGTH + PUBLIC_KEY_LENGTH)
+#define MSG_WELCOME_LENGTH (1 + NONCE_LENGTH + MAC_LENGTH \
+        + SESSION_KEY_LENGTH + TICKET_LENGTH)
+
+struct hash {
+    unsigned char hash[HASH_LENGTH];
+};
+
+struct node {
+    unsigned char fingerprint[HASH_LENGTH];
+    unsigned char public_key[PUBLIC_KEY_LENGTH];
+    char address[ADDRESS_LENGTH];
+    // As measured by the host; neither is sent to other nodes
+    float rtt;                      // smoothed round trip in seconds, or 0
+    float deviation;                // mean deviation of the round trip
+    int failures;                   // consecutive failed exchanges
+};
+
+// A bucket stores its nodes column-wise in fixed slots, so that scanning the
+//  fingerprints touches only contiguous memory.  Occupied slots are 0 to
+//  count - 1; <order> lists them from most to least recently contacted.
+//  Writers hold <mutex> and make <sequence> odd while modifying the bucket;
+//  readers take no lock, and retry if <sequence> was odd or has changed.
+struct bucket {
+    pthread_mutex_t mutex;
+    atomic_uint sequence;
+    int count;
+    uint8_t order[BUCKET_SIZE];
+    unsigned char fingerprint[BUCKET_SIZE][HASH_LENGTH];
+    unsigned char public_key[BUCKET_SIZE][PUBLIC_KEY_LENGTH];
+    char address[BUCKET_SIZE][ADDRESS_LENGTH];
+    float rtt[BUCKET_SIZE];
+    float deviation[BUCKET_SIZE];
+    uint16_t failures[BUCKET_SIZE];
+};
+
+// Number of entries in the fingerprint index; a power of two of at least
+//  twice the number of slots in the table
+#ifndef INDEX_SIZE
+#define INDEX_SIZE 16384
+#endif
+
+struct nodes {
+    struct bucket buckets[NUM_BUCKETS];
+    // Guards the index, and the fingerprints of all slots, in the same way as
+    //  a bucket.  Taken after the bucket's mutex.
+    pthread_mutex_t mutex;
+    atomic_uint sequence;
+    // Open-addressing index from fingerprint to slot, with linear probing.
+    //  An entry holds the slot number (bucket * BUCKET_SIZE + slot) plus one
+    //  in its low 16 bits, or 0 when empty, and a tag taken from the
+    //  fingerprint in its high 16 bits.
+    uint32_t index[INDEX_SIZE];
+};
+
+// A listener thread, and the socket it accepts connections on
+struct listener {
+    struct dsp *dsp;
+    pthread_t thread;
+    int socket;
+};
 
 struct dsp {
     pthread_mutex_t mutex;
     unsigned char *public_key;
     unsigned char *private_key;
+    // Hash of the public key, which every distance to the host is taken from
+    unsigned char fingerprint[HASH_LENGTH];
     struct db *db;
     char *address;
     uint16_t tcp_port;
     uint16_t udp_port;
-    pthread_t listener;
+    int num_listeners;
+    struct listener *listeners;
     struct session **session;
+    struct nodes *nodes;
+    struct cache *cache;
+    // Lookups and connection attempts in progress
+    struct flights *lookups;
+    struct flights *connects;
+    struct pool *pool;
+    struct io *io;
+    struct hedging *hedging;
+    // Tickets for resuming sessions with other nodes, and the key sealing the
+    //  tickets this node issues
+    struct sessions *sessions;
+    unsigned char ticket_key[SESSION_KEY_LENGTH];
+    struct keys *keys;
+    struct offload *offload;
+};
+
+// A request is queued on a connection with net_send.  Once the response has
+//  been read, or the connection has failed, <callback> is called from an I/O
+//  thread with the response set, or with an error it takes ownership of.
+struct request {
+    struct request *_Atomic next;
+    void *buffer;
+    size_t length;
+    void (*callback) (struct request *request, dsp_error err);
+    void *arg;                  // for use by the callback
+    // When the request was written, as a CLOCK_MONOTONIC time
+    struct timespec sent;
+    // Allocated by the I/O thread; to be freed by the callback
+    void *response;
+    size_t response_length;
+};
+
+struct connection {
+    char *address;
+    int socket;
+    struct io_loop *loop;           // the event loop serving the connection
+    // Session with the peer.  Frames are sealed under nonces made of <id>
+    //  (<reply_id> from the server) and the number of frames sealed before
+    //  in the same direction.
+    struct sessions *sessions;
+    unsigned char public_key[PUBLIC_KEY_LENGTH];    // of the peer
+    unsigned char key[SESSION_KEY_LENGTH];
+    unsigned char id[CONNECTION_ID_LENGTH];
+    unsigned char reply_id[CONNECTION_ID_LENGTH];
+    uint64_t sent;
+    uint64_t received;
+    // Set until the first request, which carries <ticket>, is sent
+    bool resuming;
+    // Set on a resumed session until the first response, which carries
+    //  <reply_id>, is read
+    bool awaiting_reply_id;
+    unsigned char ticket[TICKET_LENGTH];
+    // Lock-free queue of outgoing requests.  Producers append at <tail>; the
+    //  connection's I/O thread consumes from <head>.
+    struct request *_Atomic tail;
+    struct request *head;
+    struct request stub;
+    // Set while the connection is on its loop's ready list
+    atomic_bool scheduled;
+    struct connection *ready;       // next connection in the ready list
+    // Held by the loop until the connection is closed, and by net_send while
+    //  it runs; the last reference freed frees the connection
+    atomic_int refs;
+    // Set once the connection is being closed
+    atomic_int closing;
+    // Set once a request has failed on the connection
+    atomic_bool failed;
+    // The following belong to the I/O thread
+    bool registered;                // with the loop
+    bool watching_output;           // for the socket taking more output
+    struct connection *sibling;     // next connection registered with the loop
+    // Requests written and waiting on a response, oldest first
+    struct request *waiting;
+    struct request *last_waiting;
+    // Frames being written, and the response being read
+    size_t out_length;
+    size_t out_written;
+    unsigned char out[2 * (FRAME_HEADER_LENGTH + MAX_FRAME_LENGTH)];
+    size_t in_length;
+    unsigned char in[FRAME_HEADER_LENGTH + MAX_FRAME_LENGTH];
+    // The following are protected by the pool mutex
+    int users;
+    struct connection *chain;       // next connection in the hash chain
+    struct connection *previous;    // LRU list of idle connections
+    struct connection *next;
 };
 
 // error.c
-    typedef struct dsp_error error;
+    typedef dsp_error error;
 #define error(code, msg) new_error(code, msg)
 #define sys_error(code, err, msg) new_system_error(code, err, msg)
 #define db_error(err, msg) new_db_error(err, msg)
     dsp_error new_error (int code, char const *message);
     dsp_error new_system_error (int code, int err, char const *message);
     dsp_error new_db_error (int err, char const *message);
+    // Returns a new error object with the same code and message.
+    dsp_error copy_error (dsp_error err);
     // Writes error message to stderr.
     void log_error (dsp_error error);
 
 // crypto.c
     // Hash functions
-        error hash (
-            unsigned char *in,
-            size_t length,      // The number of bytes to read from <in>
-            char *out           // Must point to a pre-allocated buffer of size
-                                //  HASH_LENGTH
-        );
+        // fingerprint writes the fingerprint of <public_key>, its SHA-512 hash
+        //  truncated to HASH_LENGTH bytes, to <out>
+        void fingerprint (unsigned char const *public_key, unsigned char *out);
         // hash_distance computes the distance function between two hashes,
-        //  i.e. returning the byte-index at which the two hashes begin to
-        //  diverge.
-        int hash_distance (char *from, char *to);
+        //  i.e. the bit-length of their XOR, or the number of bits following
+        //  their common prefix.  Returns 0 for equal hashes, and at most
+        //  8 * HASH_LENGTH.
+        int hash_distance (unsigned char const *from, unsigned char const *to);
+        // hash_compare orders <a> and <b> by their full XOR distance to
+        //  <target>, returning a negative value if <a> is closer, positive if
+        //  <b> is closer, and 0 if they are equal.
+        int hash_compare (
+            unsigned char const *target,
+            unsigned char const *a,
+            unsigned char const *b
+        );
     // Base-64 functions
-        error encode_base64 (unsigned char *in, size_t length, char **out);
-        error decode_base64 (char *in, size_t *length, unsigned char **out);
+        // encode_base64 writes <length> bytes of <in> in padded base-64 to
+        //  <out>, followed by a terminator.
+        void encode_base64 (
+            char *out,              // OUT: BASE64_LENGTH(<length>) + 1 chars
+            unsigned char const *in,
+            size_t length
+        );
+        // decode_base64 decodes <length> characters of padded base-64 at
+        //  <in>.  Fails if the input is not base-64, or if its decoding does
+        //  not fit in <*size> bytes.
+        error decode_base64 (
+            unsigned char *out,     // OUT: decoded bytes
+            size_t *size,           // IN: size of <out>, OUT: decoded length
+            char const *in,
+            size_t length
+        );
     // Asymmetric crypto functions
         error sign_keypair (
             unsigned char **public_key,
@@ -60,29 +407,363 @@ struct dsp {
         );
         error sign ();
         error verify_sign ();
-        error encrypt ();
-        error decrypt ();
+        // Boxes between two key pairs are made with a shared key, which
+        //  costs a scalar multiplication to compute.
+        error keys_open (struct keys **keys);
+        void keys_close (struct keys *keys);
+        // precompute computes the shared key of <public_key> and
+        //  <private_key>.
+        void precompute (
+            unsigned char *key,     // OUT: SHARED_KEY_LENGTH bytes
+            unsigned char const *public_key,
+            unsigned char const *private_key
+        );
+        // shared_key returns the shared key of the host with the node of
+        //  public key <peer>, computing it only if it is not cached.
+        void shared_key (
+            struct dsp *dsp,
+            unsigned char const *peer,
+            unsigned char *key      // OUT: SHARED_KEY_LENGTH bytes
+        );
+        // encrypt boxes <length> bytes of <in> with the shared key, writing
+        //  MAC_LENGTH + <length> bytes to <out>.  <length> is at most
+        //  MAX_MESSAGE_LENGTH.
+        void encrypt (
+            unsigned char *out,
+            unsigned char const *in,
+            size_t length,
+            unsigned char const *nonce,
+            unsigned char const *key
+        );
+        // decrypt opens a box of <length> bytes made by encrypt, writing
+        //  <length> - MAC_LENGTH bytes to <out>.  Fails if the box was not
+        //  made with the shared key.
+        error decrypt (
+            unsigned char *out,
+            unsigned char const *in,
+            size_t length,
+            unsigned char const *nonce,
+            unsigned char const *key
+        );
     // Symmetric crypto functions
+        // seal and unseal are encrypt and decrypt with a shared key
+        void seal (
+            unsigned char *out,
+            unsigned char const *in,
+            size_t length,
+            unsigned char const *nonce,
+            unsigned char const *key
+        );
+        error unseal (
+            unsigned char *out,
+            unsigned char const *in,
+            size_t length,
+            unsigned char const *nonce,
+            unsigned char const *key
+        );
+
+// sha256.c
+    // hash writes the SHA-256 hash of <length> bytes of <in> to <out>.  The
+    //  SHA extensions are used when the processor has them.
+    void hash (
+        unsigned char const *in,
+        size_t length,
+        unsigned char *out      // OUT: HASH_LENGTH bytes
+    );
+    // hash_many hashes <n> messages of <length> bytes each, eight at a time
+    //  in AVX2 lanes on processors that have AVX2 but not the SHA extensions.
+    void hash_many (
+        unsigned char const *const *in,     // array of <n> messages
+        size_t length,
+        unsigned char (*out)[HASH_LENGTH],  // OUT: array of <n> hashes
+        size_t n
+    );
 
 // db.c
     error db_open (struct db **);
     error db_close (struct db *);
+    // select_node sees the writes queued by insert_node and update_node
+    //  before they are committed.
     error select_node (
         struct db *db,
         unsigned char *fingerprint,
         struct node **node
     );
+    // select_nodes looks up <n> fingerprints at once, filling in <nodes>[i]
+    //  and setting <found>[i] for each that is stored.
+    error select_nodes (
+        struct db *db,
+        unsigned char const (*fingerprints)[HASH_LENGTH],
+        int n,
+        struct node *nodes,     // OUT: array of <n> nodes
+        bool *found             // OUT: array of <n> flags
+    );
+    // insert_node and update_node queue the node to be stored, replacing any
+    //  stored with its fingerprint.  They never wait, and drop the write when
+    //  the queue is full and does not hold the node already.
     error insert_node (struct db *db, struct node *node);
     error update_node (struct db *db, struct node *node);
+    // store_node is insert_node for bulk loads, and waits for room in a full
+    //  queue instead.  It must not be called from an I/O thread.
+    error store_node (struct db *db, struct node *node);
+
+// nodes.c
+    error nodes_open (struct nodes **nodes);
+    void nodes_close (struct nodes *nodes);
+    // Routing-table lookups never block; updates are serialized per bucket.
+    // bump_node marks the node as the most recently contacted in its bucket.
+    void bump_node (struct hash *fingerprint, struct dsp *dsp);
+    // add_node stores a copy of the node.  A full bucket makes room by
+    //  dropping the node with the most consecutive failures, or else the
+    //  least recently contacted node that has never answered; when every
+    //  node has proven responsive, the new node is not added.  The round
+    //  trip and failures of <node> are ignored.  A node that is added, or
+    //  whose key or address changes, is queued to be written to the store.
+    void add_node (struct node *node, struct dsp *dsp);
+    // report_exchange records the outcome of an exchange with the node: a
+    //  success folds <rtt> (in seconds) into its smoothed round trip and
+    //  its mean deviation, and marks it as the most recently contacted; a
+    //  failure is counted.
+    void report_exchange (struct hash *fingerprint, bool ok, double rtt,
+            struct dsp *dsp);
+    // return_node copies the node with the given fingerprint into <node>.
+    //  Returns false if the node is not known.
+    bool return_node (
+        struct hash *fingerprint,
+        struct dsp *dsp,
+        struct node *node           // OUT: the node
+    );
+    // closest_nodes finds the <k> known nodes closest to <hash> by XOR
+    //  distance, and returns how many were found.
+    int closest_nodes (
+        struct hash *hash,
+        int k,
+        struct dsp *dsp,
+        struct node *nodes          // OUT: array of <k> nodes, closest first
+    );
 
 // net.c
-    error net_listen (struct dsp *dsp);
+    // net_bind opens a listener socket on the host's TCP port, which any
+    //  number of listeners may share.  If the port is 0, the port the socket
+    //  is given is set as the host's.
+    error net_bind (struct dsp *dsp, int *listener);
+    // net_listen accepts and serves inbound sessions on the listener socket,
+    //  which it closes when it returns.
+    error net_listen (struct dsp *dsp, int listener);
+    // net_connect returns a connection to <address> authenticated with
+    //  <public_key>, reusing a pooled connection to the same peer when one
+    //  exists.  A new connection resumes the last session with the peer if
+    //  its ticket is still valid, sending the ticket along with the first
+    //  request; otherwise it runs a full handshake.
+    error net_connect (
+        struct dsp *dsp,
+        char *address,
+        unsigned char const *public_key,    // of the peer
+        struct connection **connection      // OUT: the connection
+    );
+    // net_disconnect returns the connection to the pool, keeping it open for
+    //  later requests.
+    error net_disconnect (struct dsp *dsp, struct connection *connection);
+    // net_send queues a request on the connection without blocking.  Any
+    //  number of threads may send on the same connection.
+    void net_send (struct connection *connection, struct request *request);
+    // net_close has the connection's I/O thread fail its queued requests and
+    //  close its socket.
+    void net_close (struct connection *connection);
+    error io_open (struct io **io, int num_threads);
+    void io_close (struct io *io);
+
+// pool.c
+    error pool_open (struct pool **pool, int capacity);
+    void pool_close (struct pool *pool);
+    // pool_acquire returns an open connection to <address> whose peer
+    //  authenticated with <public_key>, or NULL if none is available.  Failed
+    //  connections are skipped.
+    struct connection *pool_acquire (struct pool *pool, char const *address,
+            unsigned char const *public_key);
+    // pool_insert adds a new connection with a single user.
+    void pool_insert (struct pool *pool, struct connection *connection);
+    // pool_release drops a user from the connection, making it idle when none
+    //  are left, or closing it if it has failed.
+    void pool_release (struct pool *pool, struct connection *connection);
+    // pool_remove removes a connection without closing it, e.g. when it has
+    //  failed.
+    void pool_remove (struct pool *pool, struct connection *connection);
+
+// msg.c
+    // bloom_add adds the fingerprint to a Bloom filter of BLOOM_LENGTH bytes.
+    void bloom_add (unsigned char *filter, unsigned char const *fingerprint);
+    // bloom_contains returns false if the fingerprint was definitely not
+    //  added to the filter.
+    bool bloom_contains (
+        unsigned char const *filter,
+        unsigned char const *fingerprint
+    );
+    // msg_find writes a request for the nodes closest to <target>, other than
+    //  those in <filter>, returning its length (MSG_FIND_LENGTH).
+    size_t msg_find (
+        unsigned char *buffer,
+        unsigned char const *target,
+        unsigned char const *filter // Bloom filter of nodes to leave out
+    );
+    // msg_found writes a response listing as many of the nodes as fit in
+    //  <capacity> bytes, returning its length.
+    size_t msg_found (
+        unsigned char *buffer,
+        size_t capacity,
+        struct node *nodes,
+        int n
+    );
+    // msg_parse_found reads the nodes listed in a response.
+    error msg_parse_found (
+        unsigned char const *buffer,
+        size_t length,
+        struct node *nodes,         // OUT: array of *<n> nodes
+        int *n                      // IN: size of <nodes>; OUT: nodes read
+    );
+
+// cache.c
+    enum {
+        CACHE_MISS,
+        CACHE_FOUND,
+        CACHE_NOT_FOUND         // the node was recently looked up in vain
+    };
+    struct cache_stats {
+        uint64_t hits;
+        uint64_t negative_hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+    // cache_open creates a cache of lookup results using at most about
+    //  <size> bytes.
+    error cache_open (struct cache **cache, size_t size);
+    void cache_close (struct cache *cache);
+    // cache_get returns CACHE_FOUND and copies the node if the fingerprint
+    //  has a live positive entry.
+    int cache_get (
+        struct cache *cache,
+        unsigned char const *fingerprint,
+        struct node *node           // OUT: the cached node
+    );
+    // cache_put caches the result of a lookup; a NULL <node> records that
+    //  the fingerprint was not found.
+    void cache_put (
+        struct cache *cache,
+        unsigned char const *fingerprint,
+        struct node *node
+    );
+    void cache_stats (struct cache *cache, struct cache_stats *stats);
+
+// flight.c
+    error flights_open (struct flights **flights);
+    void flights_close (struct flights *flights);
+    // flight_begin returns true if no operation for <key> is in progress: the
+    //  caller then runs it, and must report the outcome with flight_end.
+    //  Otherwise, it waits for the running operation and returns false, with
+    //  <value> and *<err> set to its outcome.
+    bool flight_begin (
+        struct flights *flights,
+        void const *key,
+        size_t length,              // at most MAX_FLIGHT_KEY_LENGTH
+        void *value,                // OUT: <size> bytes of outcome
+        size_t size,
+        error *err                  // OUT: copy of the operation's error
+    );
+    void flight_end (
+        struct flights *flights,
+        void const *key,
+        size_t length,
+        void const *value,
+        size_t size,
+        error err                   // copied; still owned by the caller
+    );
+
+// offload.c
+    // A job is run on a crypto thread, then handed back through <done>, which
+    //  is called on the same thread and must not block.
+    struct job {
+        struct job *next;
+        void (*run)(struct job *job);
+        void (*done)(struct job *job);
+    };
+    error offload_open (struct offload **offload, int num_threads);
+    // offload_close runs the jobs still queued, and stops the threads.
+    void offload_close (struct offload *offload);
+    // offload_submit queues the list of jobs from <first> to <last>, linked
+    //  by <next>, as one batch.
+    void offload_submit (struct offload *offload, struct job *first,
+            struct job *last);
+
+// session.c
+    // A resumable session, as kept by the client
+    struct ticket {
+        unsigned char ticket[TICKET_LENGTH];
+        unsigned char key[SESSION_KEY_LENGTH];
+    };
+    error sessions_open (struct sessions **sessions);
+    void sessions_close (struct sessions *sessions);
+    // session_find copies the ticket for resuming a session with <peer>, and
+    //  returns false if there is none that has not expired.
+    bool session_find (struct sessions *sessions, unsigned char const *peer,
+            struct ticket *ticket);
+    void session_store (struct sessions *sessions, unsigned char const *peer,
+            struct ticket *ticket);
+    void session_forget (struct sessions *sessions, unsigned char const *peer);
+    // session_nonce makes the nonce of the <counter>th frame sealed in the
+    //  given direction (0 from the client, 1 from the server).
+    void session_nonce (unsigned char const *id, uint64_t counter,
+            int direction, unsigned char *nonce);
+    // A full handshake: the client sends its public key and the connection
+    //  id, boxing a new ephemeral public key to the server.  The server boxes
+    //  a new session key and a ticket for it to the ephemeral key.
+    // session_hello writes a hello for <peer> of MSG_HELLO_LENGTH bytes to
+    //  <hello>, and the ephemeral private key to <secret>.
+    void session_hello (struct dsp *dsp, unsigned char const *peer,
+            unsigned char const *id, unsigned char *secret,
+            unsigned char *hello);
+    // session_welcomed opens the server's welcome into <ticket>.
+    error session_welcomed (unsigned char const *peer,
+            unsigned char const *secret, unsigned char const *welcome,
+            size_t length, struct ticket *ticket);
+    // session_greet answers a hello with a welcome of MSG_WELCOME_LENGTH
+    //  bytes, setting the connection id, session key and client public key.
+    error session_greet (struct dsp *dsp, unsigned char const *hello,
+            size_t length, unsigned char *id, unsigned char *key,
+            unsigned char *peer, unsigned char *welcome);
+    // session_redeem opens a ticket issued by this node, setting the session
+    //  key and client public key.  Fails if the ticket is forged or expired.
+    error session_redeem (struct dsp *dsp, unsigned char const *ticket,
+            unsigned char *key, unsigned char *peer);
 
 // request.c
+    struct lookup_stats {
+        int hops;                   // longest chain of referrals followed
+        int messages;               // queries sent
+        int hedges;                 // queries sent as hedges
+        int hedges_won;             // hedges that answered first
+        double seconds;             // wall-clock time
+    };
+    struct hedging_stats {
+        uint64_t sent;
+        uint64_t won;
+    };
+    dsp_error hedging_open (struct hedging **hedging);
+    void hedging_close (struct hedging *hedging);
+    void hedging_stats (struct hedging *hedging, struct hedging_stats *stats);
+    // lookup searches the network for the node with the given fingerprint,
+    //  keeping LOOKUP_ALPHA queries in flight until the LOOKUP_K closest
+    //  nodes found have answered.  A query that is slow for the node it asks
+    //  is hedged by asking the next closest candidate too, and the first of
+    //  the two to answer is taken.  *<node> is set to NULL if the node is not
+    //  found.  Fails if no node answered.  Results are cached for a while,
+    //  and so are misses once the LOOKUP_K closest nodes have all answered.
+    //  Concurrent lookups of the same fingerprint share one search.  A lookup
+    //  that did not search itself reports no messages.
     error lookup (
         struct dsp *dsp,
         struct hash *fingerprint,   // the fingerprint to find
-        struct node **node          // OUT: the returned node object
+        struct node **node,         // OUT: the returned node object
+        struct lookup_stats *stats  // OUT: may be NULL
     );
 
 // response.c
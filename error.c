@@ -76,7 +76,7 @@ dsp_error new_db_error (int db_err, char const *message)
     char const *prefix = "Database error: ";
     int i = strlen(prefix);
     char const *sqlite_err = sqlite3_errstr(db_err);
-    int l = i + strlen(sqlite_err);
+    int l = i + strlen(sqlite_err) + 1;
     if (message) l += strlen(message) + 2;
     err->message = malloc(l);
     strcpy(err->message, prefix);
@@ -90,6 +90,17 @@ dsp_error new_db_error (int db_err, char const *message)
     return err;
 }
 
+dsp_error copy_error (dsp_error err)
+{
+    dsp_error copy = calloc(1, sizeof(struct dsp_error));
+    copy->code = err->code;
+    if (err->message) {
+        copy->message = malloc(strlen(err->message) + 1);
+        strcpy(copy->message, err->message);
+    }
+    return copy;
+}
+
 void log_error (dsp_error error)
 {
     fprintf(stderr, "%s\n", error->message);
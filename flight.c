@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+
+#define NUM_CHAINS 64
+
+// A flight is one run of an operation that concurrent callers asking for the
+//  same key wait on instead of repeating it.  It is allocated by the leader
+//  and freed by whichever of the callers finishes with it last.
+struct flight {
+    struct flight *next;
+    pthread_cond_t cond;
+    bool landed;
+    int followers;
+    size_t length;
+    unsigned char key[MAX_FLIGHT_KEY_LENGTH];
+    dsp_error err;
+    unsigned char value[];
+};
+
+struct flights {
+    pthread_mutex_t mutex;
+    struct flight *chains[NUM_CHAINS];
+};
+
+/// Static functions
+
+// FNV-1a
+static struct flight **chain_of (struct flights *flights, void const *key,
+        size_t length)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; i++) {
+        h ^= ((unsigned char const *) key)[i];
+        h *= 0x100000001b3;
+    }
+    return &flights->chains[h % NUM_CHAINS];
+}
+
+static void free_flight (struct flight *flight)
+{
+    if (flight->err) dsp_error_free(flight->err);
+    pthread_cond_destroy(&flight->cond);
+    free(flight);
+}
+
+/// Extern functions
+
+dsp_error flights_open (struct flights **flights)
+{
+    if (!(*flights = calloc(1, sizeof(struct flights))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate flights");
+    pthread_mutex_init(&(*flights)->mutex, NULL);
+    return NULL;
+}
+
+void flights_close (struct flights *flights)
+{
+    // Every flight is landed and freed by its callers
+    for (int i = 0; i < NUM_CHAINS; i++) assert(!flights->chains[i]);
+    pthread_mutex_destroy(&flights->mutex);
+    free(flights);
+}
+
+bool flight_begin (struct flights *flights, void const *key, size_t length,
+        void *value, size_t size, dsp_error *err)
+{
+    assert(length <= MAX_FLIGHT_KEY_LENGTH);
+    *err = NULL;
+    pthread_mutex_lock(&flights->mutex);
+    struct flight **chain = chain_of(flights, key, length);
+    struct flight *flight = *chain;
+    while (flight && (flight->length != length
+                || memcmp(flight->key, key, length)))
+        flight = flight->next;
+    if (!flight) {
+        // Lead a new flight
+        if (!(flight = calloc(1, sizeof(struct flight) + size))) {
+            *err = sys_error(DSP_E_SYSTEM, errno, "Failed to allocate flight");
+            pthread_mutex_unlock(&flights->mutex);
+            return false;
+        }
+        pthread_cond_init(&flight->cond, NULL);
+        flight->length = length;
+        memcpy(flight->key, key, length);
+        flight->next = *chain;
+        *chain = flight;
+        pthread_mutex_unlock(&flights->mutex);
+        return true;
+    }
+    flight->followers++;
+    while (!flight->landed) pthread_cond_wait(&flight->cond, &flights->mutex);
+    if (size) memcpy(value, flight->value, size);
+    if (flight->err) *err = copy_error(flight->err);
+    if (!--flight->followers) free_flight(flight);
+    pthread_mutex_unlock(&flights->mutex);
+    return false;
+}
+
+void flight_end (struct flights *flights, void const *key, size_t length,
+        void const *value, size_t size, dsp_error err)
+{
+    pthread_mutex_lock(&flights->mutex);
+    struct flight **p = chain_of(flights, key, length);
+    while (*p && ((*p)->length != length || memcmp((*p)->key, key, length)))
+        p = &(*p)->next;
+    struct flight *flight = *p;
+    assert(flight);
+    // Later callers start a new flight
+    *p = flight->next;
+    if (size) memcpy(flight->value, value, size);
+    if (err) flight->err = copy_error(err);
+    flight->landed = true;
+    if (flight->followers) pthread_cond_broadcast(&flight->cond);
+    else free_flight(flight);
+    pthread_mutex_unlock(&flights->mutex);
+}
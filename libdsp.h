@@ -1,6 +1,8 @@
 #ifndef LIBDSP_H
 #define LIBDSP_H
 
+#include <stddef.h>
+
 // libdsp can create or connect to a dsp node.
 
 #define DSP_HASH_LENGTH 32
@@ -34,6 +36,24 @@ void dsp_error_free (
     dsp_error           // the error object to be freed
 );
 
+// dsp_hash writes the DSP_HASH_LENGTH-byte hash of <length> bytes of <in> to
+//  <out>.
+void dsp_hash (
+    void const *in,
+    size_t length,
+    unsigned char *out
+);
+
+// dsp_hash_blocks hashes <in> in blocks of <block_size> bytes, the last of
+//  which may be shorter, writing DSP_HASH_LENGTH bytes per block to <out>.
+//  Blocks are hashed several at a time where the processor allows.
+void dsp_hash_blocks (
+    void const *in,
+    size_t length,
+    size_t block_size,
+    unsigned char *out
+);
+
 // Instance object 
 struct dsp;
 
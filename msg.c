@@ -1,11 +1,107 @@
+#include <assert.h>
+#include <string.h>
+
 #include "dsp.h"
 
-struct node *msg_find (struct hash *hash, struct self *self)
+static_assert(!(BLOOM_BITS & (BLOOM_BITS - 1)),
+        "BLOOM_BITS must be a power of two");
+
+// A find request is the message type, the target fingerprint, and a Bloom
+//  filter of the nodes the sender already knows of.  The response is the
+//  message type and a node count, followed by each node's fingerprint, public
+//  key, address length and (unterminated) address.
+
+// The nodes in a filter are mostly close to one target, and share a prefix with
+//  it, so a node's filter bits are taken from the trailing word of its
+//  fingerprint, read little-endian so that every host sets the same bits.  The
+//  word is mixed by multiplication with an odd constant, and its halves give
+//  the first bit and an odd stride for the rest (double hashing).
+static void bloom_bits (unsigned char const *fingerprint, uint32_t *bits)
 {
-    return NULL;
+    unsigned char const *p = fingerprint + HASH_LENGTH - sizeof(uint64_t);
+    uint64_t word = 0;
+    for (int i = sizeof(uint64_t) - 1; i >= 0; i--) word = word << 8 | p[i];
+    word *= 0x9e3779b97f4a7c15;
+    uint32_t first = word >> 32, stride = (uint32_t) word | 1;
+    for (int i = 0; i < BLOOM_HASHES; i++)
+        bits[i] = (first + i * stride) & (BLOOM_BITS - 1);
+}
+
+void bloom_add (unsigned char *filter, unsigned char const *fingerprint)
+{
+    uint32_t bits[BLOOM_HASHES];
+    bloom_bits(fingerprint, bits);
+    for (int i = 0; i < BLOOM_HASHES; i++)
+        filter[bits[i] / 8] |= 1 << bits[i] % 8;
+}
+
+bool bloom_contains (unsigned char const *filter,
+        unsigned char const *fingerprint)
+{
+    uint32_t bits[BLOOM_HASHES];
+    bloom_bits(fingerprint, bits);
+    for (int i = 0; i < BLOOM_HASHES; i++)
+        if (!(filter[bits[i] / 8] & 1 << bits[i] % 8)) return false;
+    return true;
+}
+
+size_t msg_find (unsigned char *buffer, unsigned char const *target,
+        unsigned char const *filter)
+{
+    buffer[0] = MSG_FIND;
+    memcpy(buffer + 1, target, HASH_LENGTH);
+    memcpy(buffer + 1 + HASH_LENGTH, filter, BLOOM_LENGTH);
+    return MSG_FIND_LENGTH;
 }
 
-void send_message (void *message, struct node *node)
+size_t msg_found (unsigned char *buffer, size_t capacity, struct node *nodes,
+        int n)
 {
+    size_t length = 2;
+    int i;
+    buffer[0] = MSG_FOUND;
+    // Nodes that do not fit are left out
+    for (i = 0; i < n && i < 255; i++) {
+        size_t address_length = strnlen(nodes[i].address, ADDRESS_LENGTH - 1);
+        if (length + HASH_LENGTH + PUBLIC_KEY_LENGTH + 1 + address_length
+                > capacity)
+            break;
+        memcpy(buffer + length, nodes[i].fingerprint, HASH_LENGTH);
+        length += HASH_LENGTH;
+        memcpy(buffer + length, nodes[i].public_key, PUBLIC_KEY_LENGTH);
+        length += PUBLIC_KEY_LENGTH;
+        buffer[length++] = address_length;
+        memcpy(buffer + length, nodes[i].address, address_length);
+        length += address_length;
+    }
+    buffer[1] = i;
+    return length;
+}
 
+error msg_parse_found (unsigned char const *buffer, size_t length,
+        struct node *nodes, int *n)
+{
+    if (length < 2 || buffer[0] != MSG_FOUND)
+        return error(DSP_E_NETWORK, "Invalid response");
+    int count = buffer[1];
+    if (count > *n) count = *n;
+    size_t i = 2;
+    for (*n = 0; *n < count; (*n)++) {
+        if (length - i < HASH_LENGTH + PUBLIC_KEY_LENGTH + 1)
+            return error(DSP_E_NETWORK, "Truncated response");
+        struct node *node = &nodes[*n];
+        memcpy(node->fingerprint, buffer + i, HASH_LENGTH);
+        i += HASH_LENGTH;
+        memcpy(node->public_key, buffer + i, PUBLIC_KEY_LENGTH);
+        i += PUBLIC_KEY_LENGTH;
+        size_t address_length = buffer[i++];
+        if (length - i < address_length)
+            return error(DSP_E_NETWORK, "Truncated response");
+        memcpy(node->address, buffer + i, address_length);
+        node->address[address_length] = '\0';
+        node->rtt = node->deviation = 0;
+        node->failures = 0;
+        i += address_length;
+    }
+    return NULL;
 }
@@ -1,15 +1,79 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <nacl/randombytes.h>
 #include <netdb.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include "dsp.h"
 
 #define LISTEN_BACKLOG 128
+// Maximum number of readiness events handled per call to epoll_wait
+#define MAX_EVENTS 256
+
+// An inbound session is owned by the listener's event loop.  Data is read as it
+//  becomes available, and a request is dispatched once a full frame has been
+//  received.  The first frame either carries a hello, or a ticket along with
+//  the first request.
+struct session {
+    int socket;
+    struct sockaddr_in address;
+    // While a hello is being answered on a crypto thread, the session is not
+    //  read from.  A session closed meanwhile keeps its socket open, so that
+    //  its descriptor is not reused, until the greeting is handed back.
+    struct greeting *greeting;
+    bool closed;
+    bool established;
+    unsigned char peer[PUBLIC_KEY_LENGTH];
+    unsigned char key[SESSION_KEY_LENGTH];
+    unsigned char id[CONNECTION_ID_LENGTH];
+    // Prefix of the nonces of responses, sent along with the first one after
+    //  a resumption
+    unsigned char reply_id[CONNECTION_ID_LENGTH];
+    bool announce;
+    uint64_t sent;
+    uint64_t received;
+    // Number of bytes of the current frame received so far
+    size_t length;
+    unsigned char buffer[FRAME_HEADER_LENGTH + MAX_FRAME_LENGTH];
+};
+
+// A listener's event loop.  Greetings are gathered while handling events, and
+//  submitted to the crypto threads together; they come back on <completed>,
+//  with a wakeup through <wakeup>.
+struct loop {
+    struct dsp *dsp;
+    int epoll;
+    int wakeup;                     // eventfd
+    struct job *first;
+    struct job *last;
+    pthread_mutex_t mutex;
+    struct job *completed;
+    int pending;                    // greetings not yet handed back
+};
+
+struct greeting {
+    struct job job;
+    struct loop *loop;
+    struct session *session;
+    dsp_error err;
+    unsigned char hello[MSG_HELLO_LENGTH];
+    unsigned char welcome[FRAME_HEADER_LENGTH + MSG_WELCOME_LENGTH];
+};
 
 /// Static functions
 
@@ -40,56 +104,767 @@ static dsp_error parse_address (char *address, struct addrinfo **res)
     return NULL;
 }
 
-static void *client (void *arg)
+// Outgoing connections are served by a fixed set of I/O threads, each running
+//  an event loop over the connections given to it.  Requests are written as
+//  far as the socket takes them, and responses read as they arrive, so a slow
+//  peer only holds up its own requests.  A connection with queued requests, or
+//  being closed, is put on its loop's ready list once, and the loop is woken.
+struct io_loop {
+    pthread_t thread;
+    int epoll;
+    int wakeup;                     // eventfd
+    pthread_mutex_t mutex;
+    struct connection *ready;       // head of the ready list
+    struct connection *last;        // tail of the ready list
+    bool stopping;
+    // Connections registered with the loop, whose requests may time out
+    struct connection *registered;
+};
+
+struct io {
+    int num_threads;
+    atomic_uint next;               // loop given the next connection
+    struct io_loop *loops;
+};
+
+// The request queue of a connection is an intrusive multi-producer single-
+//  consumer queue: producers swap themselves in as the tail, and only the
+//  connection's I/O thread pops from the head.
+static void queue_push (struct connection *conn, struct request *request)
+{
+    atomic_store_explicit(&request->next, NULL, memory_order_relaxed);
+    struct request *previous = atomic_exchange_explicit(&conn->tail, request,
+            memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, request, memory_order_release);
+}
+
+// queue_pop returns NULL when the queue is empty, or when a producer has not
+//  yet linked its request; that producer schedules the connection again.
+static struct request *queue_pop (struct connection *conn)
+{
+    struct request *head = conn->head;
+    struct request *next = atomic_load_explicit(&head->next,
+            memory_order_acquire);
+    if (head == &conn->stub) {
+        if (!next) return NULL;
+        conn->head = head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if (next) {
+        conn->head = next;
+        return head;
+    }
+    if (head != atomic_load_explicit(&conn->tail, memory_order_acquire))
+        return NULL;
+    // Re-insert the stub so the last request can be detached
+    queue_push(conn, &conn->stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next) {
+        conn->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+static void schedule (struct connection *conn)
+{
+    struct io_loop *loop = conn->loop;
+    pthread_mutex_lock(&loop->mutex);
+    conn->ready = NULL;
+    bool wake = !loop->ready;
+    if (loop->last) loop->last->ready = conn;
+    else loop->ready = conn;
+    loop->last = conn;
+    pthread_mutex_unlock(&loop->mutex);
+    uint64_t one = 1;
+    if (wake && write(loop->wakeup, &one, sizeof(uint64_t)) == -1) {
+        // The counter cannot overflow, so the loop is already woken
+    }
+}
+
+// release drops a reference to the connection, freeing it with the last
+static void release (struct connection *conn)
+{
+    if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+        close(conn->socket);
+        free(conn->address);
+        free(conn);
+    }
+}
+
+static dsp_error send_all (int socket, void const *buffer, size_t length)
+{
+    while (length) {
+        ssize_t n = send(socket, buffer, length, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return sys_error(DSP_E_NETWORK, errno, "Failed to send request");
+        }
+        buffer = (char const *) buffer + n;
+        length -= n;
+    }
+    return NULL;
+}
+
+static dsp_error recv_all (int socket, void *buffer, size_t length)
+{
+    while (length) {
+        ssize_t n = recv(socket, buffer, length, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return sys_error(DSP_E_NETWORK, errno, "Failed to read response");
+        }
+        if (!n) return error(DSP_E_NETWORK, "Connection closed by peer");
+        buffer = (char *) buffer + n;
+        length -= n;
+    }
+    return NULL;
+}
+
+static dsp_error send_frame (int socket, unsigned char *frame, size_t length)
+{
+    uint32_t header = htonl(length - FRAME_HEADER_LENGTH);
+    memcpy(frame, &header, FRAME_HEADER_LENGTH);
+    return send_all(socket, frame, length);
+}
+
+// recv_frame reads a frame into <frame>, setting <length> to the length of
+//  its contents
+static dsp_error recv_frame (int socket, unsigned char *frame, size_t *length)
+{
+    uint32_t header;
+    dsp_error err = recv_all(socket, &header, FRAME_HEADER_LENGTH);
+    if (err) return err;
+    *length = ntohl(header);
+    if (*length > MAX_FRAME_LENGTH)
+        return error(DSP_E_NETWORK, "Message exceeds maximum length");
+    return recv_all(socket, frame, *length);
+}
+
+// write_request appends the request's frame to the connection's output.  The
+//  first request on a resumed session carries the ticket, and is sent without
+//  waiting on a handshake.
+static void write_request (struct connection *conn, struct request *request)
+{
+    assert(request->length <= MAX_MESSAGE_LENGTH);
+    unsigned char *frame = conn->out + conn->out_length;
+    unsigned char *p = frame + FRAME_HEADER_LENGTH;
+    if (conn->resuming) {
+        *p++ = MSG_RESUME;
+        memcpy(p, conn->id, CONNECTION_ID_LENGTH);
+        p += CONNECTION_ID_LENGTH;
+        memcpy(p, conn->ticket, TICKET_LENGTH);
+        p += TICKET_LENGTH;
+        conn->resuming = false;
+    } else {
+        *p++ = MSG_SEALED;
+    }
+    unsigned char nonce[NONCE_LENGTH];
+    session_nonce(conn->id, conn->sent++, 0, nonce);
+    seal(p, request->buffer, request->length, nonce, conn->key);
+    p += MAC_LENGTH + request->length;
+    uint32_t header = htonl(p - frame - FRAME_HEADER_LENGTH);
+    memcpy(frame, &header, FRAME_HEADER_LENGTH);
+    conn->out_length = p - conn->out;
+}
+
+// read_response opens a response frame of <length> bytes into the request
+static dsp_error read_response (struct connection *conn, unsigned char *frame,
+        size_t length, struct request *request)
+{
+    if (length == 1 && frame[0] == MSG_REJECT) {
+        // Later connections run a full handshake
+        session_forget(conn->sessions, conn->public_key);
+        return error(DSP_E_NETWORK, "Session ticket rejected");
+    }
+    if (conn->awaiting_reply_id) {
+        if (length < 1 + CONNECTION_ID_LENGTH + MAC_LENGTH
+                || frame[0] != MSG_RESUMED)
+            return error(DSP_E_NETWORK, "Invalid response frame");
+        memcpy(conn->reply_id, frame + 1, CONNECTION_ID_LENGTH);
+        conn->awaiting_reply_id = false;
+        frame += CONNECTION_ID_LENGTH;
+        length -= CONNECTION_ID_LENGTH;
+    } else if (length < 1 + MAC_LENGTH || frame[0] != MSG_SEALED) {
+        return error(DSP_E_NETWORK, "Invalid response frame");
+    }
+    length -= 1 + MAC_LENGTH;
+    if (!(request->response = malloc(length ? length : 1)))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate response");
+    request->response_length = length;
+    unsigned char nonce[NONCE_LENGTH];
+    session_nonce(conn->reply_id, conn->received++, 1, nonce);
+    dsp_error err = unseal(request->response, frame + 1, MAC_LENGTH + length,
+            nonce, conn->key);
+    if (err) {
+        free(request->response);
+        request->response = NULL;
+        return err;
+    }
+    return NULL;
+}
+
+// complete hands the request back to its owner.  Requests on a failed
+//  connection each get their own error, as the callback owns it.
+static void complete (struct request *request, bool failed)
+{
+    request->callback(request, failed ?
+            error(DSP_E_NETWORK, "Request failed: connection lost") : NULL);
+}
+
+// watch_output asks the loop to report when the socket takes more, for as
+//  long as part of the output is left to write
+static void watch_output (struct connection *conn, bool watch)
+{
+    if (!conn->registered || conn->watching_output == watch) return;
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP
+            | (watch ? EPOLLOUT : 0), .data.ptr = conn};
+    if (!epoll_ctl(conn->loop->epoll, EPOLL_CTL_MOD, conn->socket, &event))
+        conn->watching_output = watch;
+}
+
+static void unregister (struct connection *conn)
+{
+    if (!conn->registered) return;
+    epoll_ctl(conn->loop->epoll, EPOLL_CTL_DEL, conn->socket, NULL);
+    struct connection **p = &conn->loop->registered;
+    while (*p != conn) p = &(*p)->sibling;
+    *p = conn->sibling;
+    conn->registered = false;
+}
+
+// fail_requests fails every request written or queued on the connection
+static void fail_requests (struct connection *conn)
+{
+    conn->out_length = conn->out_written = 0;
+    struct request *request;
+    while (request = conn->waiting) {
+        conn->waiting = atomic_load_explicit(&request->next,
+                memory_order_relaxed);
+        complete(request, true);
+    }
+    conn->last_waiting = NULL;
+    while (request = queue_pop(conn)) complete(request, true);
+}
+
+// fail_connection takes the connection out of the loop and fails its
+//  requests.  The pool no longer hands it out, and later requests fail at once.
+static void fail_connection (struct connection *conn, dsp_error err)
+{
+    log_error(err);
+    dsp_error_free(err);
+    atomic_store(&conn->failed, true);
+    unregister(conn);
+    fail_requests(conn);
+}
+
+// flush writes the connection's queued requests for as long as the socket
+//  takes them.  Each request waits for its response from the time it is
+//  written, and responses come back in the same order.
+static void flush (struct connection *conn)
 {
-    struct connection *conn = arg;
-    int ret = pthread_mutex_lock(&conn->mutex);
-    if (ret) return sys_error(DSP_E_SYSTEM, ret, NULL);
     while (1) {
-        // The client blocks until it is signalled that there is a request in
-        //  its buffer
-        while (!conn->buffer) {
-            if (ret = pthread_cond_wait(&conn->cond, &conn->mutex))
-                return sys_error(DSP_E_SYSTEM, ret, NULL);
-        }
-        // Send request
-        dsp_error err = send_request(conn);
+        if (conn->out_written == conn->out_length) {
+            conn->out_length = conn->out_written = 0;
+            // Frames are gathered into one write while the largest still fits
+            struct request *request;
+            while (conn->out_length + FRAME_HEADER_LENGTH + MAX_FRAME_LENGTH
+                    <= sizeof(conn->out) && (request = queue_pop(conn))) {
+                if (atomic_load_explicit(&conn->failed,
+                            memory_order_relaxed)) {
+                    complete(request, true);
+                    continue;
+                }
+                write_request(conn, request);
+                clock_gettime(CLOCK_MONOTONIC, &request->sent);
+                atomic_store_explicit(&request->next, NULL,
+                        memory_order_relaxed);
+                if (conn->last_waiting)
+                    atomic_store_explicit(&conn->last_waiting->next, request,
+                            memory_order_relaxed);
+                else conn->waiting = request;
+                conn->last_waiting = request;
+            }
+            if (!conn->out_length) break;
+        }
+        ssize_t n = send(conn->socket, conn->out + conn->out_written,
+                conn->out_length - conn->out_written, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            fail_connection(conn, sys_error(DSP_E_NETWORK, errno,
+                        "Failed to send request"));
+            return;
+        }
+        conn->out_written += n;
+    }
+    watch_output(conn, conn->out_written < conn->out_length);
+}
+
+// receive reads whatever the socket has without blocking, and hands each
+//  complete response to the oldest request waiting on it
+static void receive (struct connection *conn)
+{
+    while (conn->registered) {
+        ssize_t n = recv(conn->socket, conn->in + conn->in_length,
+                sizeof(conn->in) - conn->in_length, 0);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR) continue;
+            fail_connection(conn, sys_error(DSP_E_NETWORK, errno,
+                        "Failed to read response"));
+            return;
+        }
+        if (!n) {
+            fail_connection(conn, error(DSP_E_NETWORK,
+                        "Connection closed by peer"));
+            return;
+        }
+        conn->in_length += n;
+        dsp_error err = NULL;
+        while (conn->in_length >= FRAME_HEADER_LENGTH) {
+            uint32_t length;
+            memcpy(&length, conn->in, FRAME_HEADER_LENGTH);
+            length = ntohl(length);
+            if (length > MAX_FRAME_LENGTH) {
+                err = error(DSP_E_NETWORK, "Message exceeds maximum length");
+                break;
+            }
+            size_t frame = FRAME_HEADER_LENGTH + length;
+            if (conn->in_length < frame) break;
+            struct request *request = conn->waiting;
+            if (!request) {
+                err = error(DSP_E_NETWORK, "Unexpected response");
+                break;
+            }
+            if (err = read_response(conn, conn->in + FRAME_HEADER_LENGTH,
+                        length, request))
+                break;
+            if (!(conn->waiting = atomic_load_explicit(&request->next,
+                            memory_order_relaxed)))
+                conn->last_waiting = NULL;
+            conn->in_length -= frame;
+            memmove(conn->in, conn->in + frame, conn->in_length);
+            complete(request, false);
+        }
         if (err) {
-            if (ret = pthread_mutex_unlock(&conn->mutex))
-                return sys_error(DSP_E_SYSTEM, ret, NULL);
+            fail_connection(conn, err);
+            return;
+        }
+    }
+}
+
+// expire fails the connections whose oldest request has waited REQUEST_TIMEOUT
+//  seconds, and returns the milliseconds until the next one may, or -1
+static int expire (struct io_loop *loop)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int timeout = -1;
+    struct connection *conn = loop->registered;
+    while (conn) {
+        struct connection *next = conn->sibling;
+        if (conn->waiting) {
+            double waited = (now.tv_sec - conn->waiting->sent.tv_sec)
+                + (now.tv_nsec - conn->waiting->sent.tv_nsec) / 1e9;
+            if (waited >= REQUEST_TIMEOUT) {
+                fail_connection(conn, error(DSP_E_NETWORK,
+                            "Request timed out"));
+            } else {
+                int left = (REQUEST_TIMEOUT - waited) * 1000 + 1;
+                if (timeout < 0 || left < timeout) timeout = left;
+            }
+        }
+        conn = next;
+    }
+    return timeout;
+}
+
+// close_connection fails whatever is still in flight or queued, and drops the
+//  loop's reference
+static void close_connection (struct connection *conn)
+{
+    unregister(conn);
+    fail_requests(conn);
+    release(conn);
+}
+
+// serve takes a connection off the ready list: a new connection is registered
+//  with the loop, queued requests are written, and a connection being closed
+//  is closed.  Its scheduled flag stays set once it is closing, so that it is
+//  never put on the list again.
+static void serve (struct io_loop *loop, struct connection *conn)
+{
+    while (!atomic_load(&conn->closing)) {
+        // Taking the flag with a read sees every request linked before it
+        //  was last set
+        atomic_exchange(&conn->scheduled, false);
+        if (!atomic_load(&conn->closing)) {
+            if (!conn->registered && !atomic_load(&conn->failed)) {
+                struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP,
+                        .data.ptr = conn};
+                if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, conn->socket,
+                            &event)) {
+                    fail_connection(conn, sys_error(DSP_E_SYSTEM, errno,
+                                "Failed to register connection"));
+                } else {
+                    conn->registered = true;
+                    conn->sibling = loop->registered;
+                    loop->registered = conn;
+                }
+            }
+            flush(conn);
+            return;
+        }
+        // Closed meanwhile: take the flag back, unless the connection has
+        //  been listed again
+        if (atomic_exchange(&conn->scheduled, true)) return;
+    }
+    close_connection(conn);
+}
+
+static void *io_thread (void *arg)
+{
+    struct io_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(loop->epoll, events, MAX_EVENTS, expire(loop));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            dsp_error err = sys_error(DSP_E_SYSTEM, errno,
+                    "Failed to wait on events");
+            log_error(err);
+            dsp_error_free(err);
+            break;
+        }
+        bool woken = false;
+        for (int i = 0; i < n; i++) {
+            struct connection *conn = events[i].data.ptr;
+            if (!conn) {
+                woken = true;
+                continue;
+            }
+            // The connection may have failed on an earlier event
+            if (conn->registered && events[i].events & EPOLLOUT) flush(conn);
+            if (conn->registered && events[i].events & ~EPOLLOUT)
+                receive(conn);
+        }
+        if (!woken) continue;
+        uint64_t count;
+        if (read(loop->wakeup, &count, sizeof(uint64_t)) == -1) {
+            // Spurious: nothing has been listed
+        }
+        // Connections are closed only here, once no more events refer to them
+        pthread_mutex_lock(&loop->mutex);
+        struct connection *conn = loop->ready;
+        loop->ready = loop->last = NULL;
+        bool stopping = loop->stopping;
+        pthread_mutex_unlock(&loop->mutex);
+        while (conn) {
+            struct connection *next = conn->ready;
+            serve(loop, conn);
+            conn = next;
+        }
+        if (stopping) break;
+    }
+    return NULL;
+}
+
+// respond sends a framed response on the non-blocking session socket.
+//  Responses are small enough to fit in the socket buffer, so a session that
+//  cannot take one at once is treated as failed.
+static dsp_error respond (struct session *session, unsigned char *frame,
+        size_t length)
+{
+    uint32_t header = htonl(length - FRAME_HEADER_LENGTH);
+    memcpy(frame, &header, FRAME_HEADER_LENGTH);
+    while (length) {
+        ssize_t n = send(session->socket, frame, length, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return sys_error(DSP_E_NETWORK, errno, "Failed to send response");
+        }
+        frame += n;
+        length -= n;
+    }
+    return NULL;
+}
+
+// answer builds the response to a request
+static dsp_error answer (struct dsp *dsp, unsigned char *message, size_t length,
+        unsigned char *response, size_t *response_length)
+{
+    if (!length) return error(DSP_E_NETWORK, "Empty message");
+    switch (message[0]) {
+    case MSG_FIND: {
+        if (length != MSG_FIND_LENGTH)
+            return error(DSP_E_NETWORK, "Invalid find request");
+        struct hash target;
+        memcpy(target.hash, message + 1, HASH_LENGTH);
+        unsigned char *filter = message + 1 + HASH_LENGTH;
+        // Select from beyond the closest, to make up for nodes the sender
+        //  already knows of
+        struct node nodes[2 * LOOKUP_K];
+        int n = closest_nodes(&target, 2 * LOOKUP_K, dsp, nodes), m = 0;
+        for (int i = 0; i < n && m < LOOKUP_K; i++)
+            if (!bloom_contains(filter, nodes[i].fingerprint))
+                nodes[m++] = nodes[i];
+        *response_length = msg_found(response, MAX_MESSAGE_LENGTH, nodes, m);
+        return NULL;
+    }
+    default:
+        return error(DSP_E_NETWORK, "Unknown message type");
+    }
+}
+
+static void greet (struct job *job)
+{
+    struct greeting *greeting = (struct greeting *) job;
+    struct session *session = greeting->session;
+    greeting->err = session_greet(greeting->loop->dsp, greeting->hello,
+            MSG_HELLO_LENGTH, session->id, session->key, session->peer,
+            greeting->welcome + FRAME_HEADER_LENGTH);
+}
+
+// Hands the greeting back to its loop, waking the loop only if it has nothing
+//  to pick up yet
+static void greeted (struct job *job)
+{
+    struct loop *loop = ((struct greeting *) job)->loop;
+    pthread_mutex_lock(&loop->mutex);
+    bool wake = !loop->completed;
+    job->next = loop->completed;
+    loop->completed = job;
+    pthread_mutex_unlock(&loop->mutex);
+    uint64_t one = 1;
+    if (wake && write(loop->wakeup, &one, sizeof(uint64_t)) == -1) {
+        // The counter cannot overflow, so the loop is already woken
+    }
+}
+
+// A hello is answered on a crypto thread: the session stops being read until
+//  the welcome is sent
+static dsp_error defer_hello (struct loop *loop, struct session *session,
+        unsigned char *hello, size_t length)
+{
+    if (session->established || length != MSG_HELLO_LENGTH)
+        return error(DSP_E_NETWORK, "Unexpected hello");
+    struct greeting *greeting = malloc(sizeof(struct greeting));
+    if (!greeting)
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate greeting");
+    struct epoll_event event = {.events = 0, .data.ptr = session};
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_MOD, session->socket, &event)) {
+        dsp_error err = sys_error(DSP_E_SYSTEM, errno,
+                "Failed to pause session");
+        free(greeting);
+        return err;
+    }
+    greeting->job.run = greet;
+    greeting->job.done = greeted;
+    greeting->job.next = NULL;
+    greeting->loop = loop;
+    greeting->session = session;
+    memcpy(greeting->hello, hello, MSG_HELLO_LENGTH);
+    session->greeting = greeting;
+    if (loop->last) loop->last->next = &greeting->job;
+    else loop->first = &greeting->job;
+    loop->last = &greeting->job;
+    loop->pending++;
+    return NULL;
+}
+
+// dispatch handles a frame: a handshake, or a sealed request which is answered
+//  in a sealed frame
+static dsp_error dispatch (struct loop *loop, struct session *session,
+        unsigned char *frame, size_t length)
+{
+    struct dsp *dsp = loop->dsp;
+    if (!length) return error(DSP_E_NETWORK, "Empty frame");
+    unsigned char *sealed = frame + 1;
+    size_t sealed_length = length - 1;
+    dsp_error err;
+    switch (frame[0]) {
+    case MSG_HELLO:
+        return defer_hello(loop, session, frame, length);
+    case MSG_RESUME:
+        if (session->established || length < 1 + CONNECTION_ID_LENGTH
+                + TICKET_LENGTH)
+            return error(DSP_E_NETWORK, "Unexpected resumption");
+        memcpy(session->id, frame + 1, CONNECTION_ID_LENGTH);
+        if (err = session_redeem(dsp, frame + 1 + CONNECTION_ID_LENGTH,
+                    session->key, session->peer)) {
+            // The client falls back to a full handshake
+            unsigned char reject[FRAME_HEADER_LENGTH + 1] = {
+                [FRAME_HEADER_LENGTH] = MSG_REJECT};
+            dsp_error e = respond(session, reject, sizeof(reject));
+            if (e) dsp_error_free(e);
             return err;
         }
+        // An eavesdropper may replay the first request, which is harmless
+        //  as long as requests only read.  The response must still never be
+        //  sealed twice under the same nonce, so each resumption is answered
+        //  under a new prefix, sent in the clear with the first response.
+        randombytes(session->reply_id, CONNECTION_ID_LENGTH);
+        session->announce = true;
+        session->established = true;
+        sealed += CONNECTION_ID_LENGTH + TICKET_LENGTH;
+        sealed_length -= CONNECTION_ID_LENGTH + TICKET_LENGTH;
+        break;
+    case MSG_SEALED:
+        if (!session->established)
+            return error(DSP_E_NETWORK, "Request before handshake");
+        break;
+    default:
+        return error(DSP_E_NETWORK, "Unknown frame type");
+    }
+    unsigned char message[MAX_MESSAGE_LENGTH], nonce[NONCE_LENGTH];
+    session_nonce(session->id, session->received++, 0, nonce);
+    if (err = unseal(message, sealed, sealed_length, nonce, session->key))
+        return err;
+    unsigned char response[FRAME_HEADER_LENGTH + 1 + CONNECTION_ID_LENGTH
+        + MAC_LENGTH + MAX_MESSAGE_LENGTH];
+    unsigned char reply[MAX_MESSAGE_LENGTH];
+    size_t reply_length = 0;
+    if (err = answer(dsp, message, sealed_length - MAC_LENGTH, reply,
+                &reply_length))
+        return err;
+    unsigned char *p = response + FRAME_HEADER_LENGTH;
+    if (session->announce) {
+        *p++ = MSG_RESUMED;
+        memcpy(p, session->reply_id, CONNECTION_ID_LENGTH);
+        p += CONNECTION_ID_LENGTH;
+        session->announce = false;
+    } else {
+        *p++ = MSG_SEALED;
+    }
+    session_nonce(session->reply_id, session->sent++, 1, nonce);
+    seal(p, reply, reply_length, nonce, session->key);
+    return respond(session, response, p + MAC_LENGTH + reply_length - response);
+}
+
+// process dispatches every complete frame in the session's buffer, stopping at
+//  a hello until it is answered
+static dsp_error process (struct loop *loop, struct session *session)
+{
+    while (!session->greeting && session->length >= FRAME_HEADER_LENGTH) {
+        uint32_t length;
+        memcpy(&length, session->buffer, FRAME_HEADER_LENGTH);
+        length = ntohl(length);
+        if (length > MAX_FRAME_LENGTH)
+            return error(DSP_E_NETWORK, "Message exceeds maximum length");
+        size_t frame = FRAME_HEADER_LENGTH + length;
+        if (session->length < frame) break;
+        dsp_error err = dispatch(loop, session,
+                session->buffer + FRAME_HEADER_LENGTH, length);
+        if (err) return err;
+        session->length -= frame;
+        memmove(session->buffer, session->buffer + frame, session->length);
     }
     return NULL;
 }
 
-static dsp_error handle (struct dsp *dsp, int client, struct sockaddr_in *client_address)
+// handle reads whatever is available on the session's socket without blocking,
+//  dispatching every complete frame.  <done> is set when the peer has closed
+//  the connection.
+static dsp_error handle (struct loop *loop, struct session *session, bool *done)
 {
+    *done = false;
+    while (!session->greeting) {
+        ssize_t n = recv(session->socket, session->buffer + session->length,
+                sizeof(session->buffer) - session->length, 0);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return NULL;
+            if (errno == EINTR) continue;
+            return sys_error(DSP_E_SYSTEM, errno, "Failed to read session");
+        }
+        if (!n) {
+            *done = true;
+            return NULL;
+        }
+        session->length += n;
+        dsp_error err = process(loop, session);
+        if (err) return err;
+    }
     return NULL;
 }
 
-/// Extern functions
+static void close_session (int epoll, struct session *session)
+{
+    epoll_ctl(epoll, EPOLL_CTL_DEL, session->socket, NULL);
+    if (session->greeting) {
+        session->closed = true;
+        return;
+    }
+    close(session->socket);
+    free(session);
+}
 
-//TODO: allow ipv6
-dsp_error net_listen (struct dsp *dsp)
+// welcome finishes the handshakes handed back by the crypto threads, and
+//  resumes their sessions
+static void welcome (struct loop *loop)
 {
-    int listener = socket(AF_INET, SOCK_STREAM, 0);
-    if (listener == -1) return sys_error(DSP_E_SYSTEM, errno,
-            "Failed to open listener network socket");
-    // Port in network order
-    uint16_t port = htons(dsp->tcp_port);
-    struct sockaddr_in address = {AF_INET, port, INADDR_ANY};
-    if (bind(listener, (struct sockaddr *) &address,
-                sizeof(struct sockaddr_in)))
-        return sys_error(DSP_E_SYSTEM, errno, "Failed to bind listener port");
-    if (listen(listener, LISTEN_BACKLOG))
-        return sys_error(DSP_E_SYSTEM, errno, NULL);
-    int client;
-    struct sockaddr_in client_address;
-    while (client = accept(listener, (struct sockaddr *) &client_address,
-                (socklen_t *) sizeof(struct sockaddr_in))) {
+    uint64_t count;
+    if (read(loop->wakeup, &count, sizeof(uint64_t)) == -1) {
+        // Spurious: nothing has been handed back
+    }
+    pthread_mutex_lock(&loop->mutex);
+    struct job *job = loop->completed;
+    loop->completed = NULL;
+    pthread_mutex_unlock(&loop->mutex);
+    while (job) {
+        struct greeting *greeting = (struct greeting *) job;
+        struct session *session = greeting->session;
+        job = job->next;
+        loop->pending--;
+        session->greeting = NULL;
+        dsp_error err = greeting->err;
+        if (session->closed) {
+            if (err) dsp_error_free(err);
+            close(session->socket);
+            free(session);
+            free(greeting);
+            continue;
+        }
+        if (!err) {
+            session->established = true;
+            memcpy(session->reply_id, session->id, CONNECTION_ID_LENGTH);
+            err = respond(session, greeting->welcome,
+                    sizeof(greeting->welcome));
+        }
+        free(greeting);
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP,
+                .data.ptr = session};
+        if (!err && epoll_ctl(loop->epoll, EPOLL_CTL_MOD, session->socket,
+                    &event))
+            err = sys_error(DSP_E_SYSTEM, errno, "Failed to resume session");
+        // Frames received along with the hello
+        if (!err) err = process(loop, session);
+        if (err) {
+            log_error(err);
+            dsp_error_free(err);
+            close_session(loop->epoll, session);
+        }
+    }
+}
+
+// accept_sessions accepts every pending connection on the (non-blocking)
+//  listener and registers it with the event loop.
+static dsp_error accept_sessions (int epoll, int listener)
+{
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t length = sizeof(struct sockaddr_in);
+        int client = accept4(listener, (struct sockaddr *) &address, &length,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (client < 0) {
             switch (errno) {
+            case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+            case EWOULDBLOCK:
+#endif
+                return NULL;
+            case EINTR:
+            case ECONNABORTED:
             case ENETDOWN:
             case EPROTO:
             case ENOPROTOOPT:
@@ -103,23 +878,190 @@ dsp_error net_listen (struct dsp *dsp)
             return sys_error(DSP_E_SYSTEM, errno,
                     "Failed to accept connection");
         }
-        dsp_error err;
-        if (err = handle(dsp, client, &client_address)) return err;
+        struct session *session = malloc(sizeof(struct session));
+        if (!session) {
+            close(client);
+            return sys_error(DSP_E_SYSTEM, errno,
+                    "Failed to allocate session");
+        }
+        session->socket = client;
+        session->address = address;
+        session->greeting = NULL;
+        session->closed = false;
+        session->established = false;
+        session->announce = false;
+        session->sent = session->received = 0;
+        session->length = 0;
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP,
+                .data.ptr = session};
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, client, &event)) {
+            dsp_error err = sys_error(DSP_E_SYSTEM, errno,
+                    "Failed to register session");
+            close(client);
+            free(session);
+            return err;
+        }
     }
+}
+
+// serve_sessions runs the event loop until waiting on events fails
+static dsp_error serve_sessions (struct loop *loop, int listener)
+{
+    struct epoll_event events[MAX_EVENTS];
+    dsp_error err = NULL;
+    while (!err) {
+        int n = epoll_wait(loop->epoll, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            err = sys_error(DSP_E_SYSTEM, errno, "Failed to wait on events");
+            break;
+        }
+        bool woken = false;
+        for (int i = 0; i < n; i++) {
+            struct session *session = events[i].data.ptr;
+            if (!session) {
+                if (err = accept_sessions(loop->epoll, listener)) break;
+                continue;
+            }
+            if (session == (struct session *) loop) {
+                woken = true;
+                continue;
+            }
+            bool done = events[i].events & (EPOLLERR | EPOLLHUP);
+            if (!done) {
+                // A failing session is dropped without affecting the others
+                dsp_error e = handle(loop, session, &done);
+                if (e) {
+                    log_error(e);
+                    dsp_error_free(e);
+                    done = true;
+                }
+            }
+            if (done) close_session(loop->epoll, session);
+        }
+        if (loop->first) {
+            offload_submit(loop->dsp->offload, loop->first, loop->last);
+            loop->first = loop->last = NULL;
+        }
+        // Handed-back greetings may close sessions, so they are seen to only
+        //  once no more events refer to them
+        if (woken) welcome(loop);
+    }
+    // Greetings refer to the loop
+    while (loop->pending) {
+        struct epoll_event ready;
+        if (epoll_wait(loop->epoll, &ready, 1, -1) == 1
+                && ready.data.ptr == loop)
+            welcome(loop);
+    }
+    return err;
+}
+
+/// Extern functions
+
+//TODO: allow ipv6
+// Every listener binds its own socket to the same port, and the kernel
+//  balances incoming connections between them.  A port of the system's choosing
+//  is read back from the first socket, so that the others join it.
+dsp_error net_bind (struct dsp *dsp, int *listener)
+{
+    *listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (*listener == -1) return sys_error(DSP_E_SYSTEM, errno,
+            "Failed to open listener network socket");
+    int enable = 1;
+    // Port in network order
+    struct sockaddr_in address = {AF_INET, htons(dsp->tcp_port), INADDR_ANY};
+    socklen_t length = sizeof(struct sockaddr_in);
+    dsp_error err = NULL;
+    if (setsockopt(*listener, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)))
+        err = sys_error(DSP_E_SYSTEM, errno,
+                "Failed to enable port reuse on listener");
+    else if (bind(*listener, (struct sockaddr *) &address,
+                sizeof(struct sockaddr_in)))
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to bind listener port");
+    else if (listen(*listener, LISTEN_BACKLOG))
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to listen on port");
+    else if (!dsp->tcp_port && getsockname(*listener,
+                (struct sockaddr *) &address, &length))
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to read listener port");
+    if (err) {
+        close(*listener);
+        *listener = -1;
+        return err;
+    }
+    dsp->tcp_port = ntohs(address.sin_port);
     return NULL;
 }
 
+// net_listen runs an inbound event loop: the listener and every accepted
+//  session are non-blocking and multiplexed with epoll, so a slow peer never
+//  stalls other sessions.  Each listener thread runs its own loop.
+dsp_error net_listen (struct dsp *dsp, int listener)
+{
+    struct loop loop = {.dsp = dsp, .wakeup = -1};
+    dsp_error err = NULL;
+    if ((loop.epoll = epoll_create1(EPOLL_CLOEXEC)) == -1
+            || (loop.wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to create event loop");
+    // The listener is registered without a session, and the wakeup with the
+    //  loop
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (!err && epoll_ctl(loop.epoll, EPOLL_CTL_ADD, listener, &event))
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to register listener");
+    event.data.ptr = &loop;
+    if (!err && epoll_ctl(loop.epoll, EPOLL_CTL_ADD, loop.wakeup, &event))
+        err = sys_error(DSP_E_SYSTEM, errno, "Failed to register wakeup");
+    if (!err) {
+        pthread_mutex_init(&loop.mutex, NULL);
+        err = serve_sessions(&loop, listener);
+        pthread_mutex_destroy(&loop.mutex);
+    }
+    if (loop.wakeup != -1) close(loop.wakeup);
+    if (loop.epoll != -1) close(loop.epoll);
+    close(listener);
+    return err;
+}
+
 //TODO: NAT hole-punching
-dsp_error net_connect (char *address, struct connection **connection)
+// handshake runs a full handshake on the new connection, and keeps the ticket
+//  for resuming the session on later connections
+static dsp_error handshake (struct dsp *dsp, struct connection *conn)
+{
+    unsigned char hello[FRAME_HEADER_LENGTH + MSG_HELLO_LENGTH];
+    unsigned char secret[PRIVATE_KEY_LENGTH];
+    session_hello(dsp, conn->public_key, conn->id, secret,
+            hello + FRAME_HEADER_LENGTH);
+    dsp_error err = send_frame(conn->socket, hello, sizeof(hello));
+    if (err) return err;
+    unsigned char welcome[MAX_FRAME_LENGTH];
+    size_t length;
+    if (err = recv_frame(conn->socket, welcome, &length)) return err;
+    struct ticket ticket;
+    if (err = session_welcomed(conn->public_key, secret, welcome, length,
+                &ticket))
+        return err;
+    memcpy(conn->key, ticket.key, SESSION_KEY_LENGTH);
+    session_store(dsp->sessions, conn->public_key, &ticket);
+    return NULL;
+}
+
+static dsp_error connect_new (struct dsp *dsp, char *address,
+        unsigned char const *public_key, struct connection **connection)
 {
     if (!(*connection = calloc(1, sizeof(struct connection)))) {
         return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate connection object");
     }
-    (*connection)->address = address;
+    // The address outlives the caller's string as the connection's pool key
+    if (!((*connection)->address = strdup(address))) {
+        free(*connection);
+        *connection = NULL;
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate connection object");
+    }
     struct addrinfo *res, *rp;
     // Perform an address lookup
     dsp_error err = parse_address(address, &res);
     if (err) {
+        free((*connection)->address);
         free(*connection);
         *connection = NULL;
         return err;
@@ -129,10 +1071,23 @@ dsp_error net_connect (char *address, struct connection **connection)
         (*connection)->socket = socket(rp->ai_family, rp->ai_socktype,
                 rp->ai_protocol);
         if ((*connection)->socket == -1) continue;
-        if (!connect((*connection)->socket, rp->ai_addr, rp->ai_addrlen))
+        if (!connect((*connection)->socket, rp->ai_addr, rp->ai_addrlen)) {
+            // The handshake is run blocking, and a peer that stops
+            //  responding fails it
+            struct timeval timeout = {REQUEST_TIMEOUT, 0};
+            setsockopt((*connection)->socket, SOL_SOCKET, SO_RCVTIMEO,
+                    &timeout, sizeof(struct timeval));
+            setsockopt((*connection)->socket, SOL_SOCKET, SO_SNDTIMEO,
+                    &timeout, sizeof(struct timeval));
+            // Requests are small and written header first
+            int enable = 1;
+            setsockopt((*connection)->socket, IPPROTO_TCP, TCP_NODELAY,
+                    &enable, sizeof(int));
             break;
+        }
         if (close((*connection)->socket)) {
             freeaddrinfo(res);
+            free((*connection)->address);
             free(*connection);
             *connection = NULL;
             return sys_error(DSP_E_SYSTEM, errno,
@@ -141,6 +1096,7 @@ dsp_error net_connect (char *address, struct connection **connection)
     }
     if (!rp) {
         freeaddrinfo(res);
+        free((*connection)->address);
         free(*connection);
         *connection = NULL;
         char *msg = NULL;
@@ -148,19 +1104,167 @@ dsp_error net_connect (char *address, struct connection **connection)
         return error(DSP_E_NETWORK, msg);
     }
     freeaddrinfo(res);
-    if (err = handshake(*connection)) return err;
-    // Initialize client thread
-    int ret = pthread_create(&(*connection)->thread, NULL, client,
-            *connection);
-    if (ret) {
+    (*connection)->sessions = dsp->sessions;
+    memcpy((*connection)->public_key, public_key, PUBLIC_KEY_LENGTH);
+    randombytes((*connection)->id, CONNECTION_ID_LENGTH);
+    struct ticket ticket;
+    if (session_find(dsp->sessions, public_key, &ticket)) {
+        memcpy((*connection)->key, ticket.key, SESSION_KEY_LENGTH);
+        memcpy((*connection)->ticket, ticket.ticket, TICKET_LENGTH);
+        (*connection)->resuming = (*connection)->awaiting_reply_id = true;
+    } else if (err = handshake(dsp, *connection)) {
+        close((*connection)->socket);
+        free((*connection)->address);
         free(*connection);
         *connection = NULL;
-        return sys_error(DSP_E_SYSTEM, ret, "Failed to create connection thread");
+        return err;
+    } else {
+        memcpy((*connection)->reply_id, (*connection)->id,
+                CONNECTION_ID_LENGTH);
+    }
+    // From here on the connection is served by an event loop
+    int flags = fcntl((*connection)->socket, F_GETFL);
+    if (flags == -1 || fcntl((*connection)->socket, F_SETFL,
+                flags | O_NONBLOCK)) {
+        err = sys_error(DSP_E_SYSTEM, errno,
+                "Failed to make connection non-blocking");
+        close((*connection)->socket);
+        free((*connection)->address);
+        free(*connection);
+        *connection = NULL;
+        return err;
+    }
+    struct io *io = dsp->io;
+    (*connection)->loop = &io->loops[atomic_fetch_add(&io->next, 1)
+        % io->num_threads];
+    atomic_init(&(*connection)->refs, 1);
+    // Initialize the request queue
+    atomic_init(&(*connection)->stub.next, NULL);
+    atomic_init(&(*connection)->tail, &(*connection)->stub);
+    (*connection)->head = &(*connection)->stub;
+    atomic_init(&(*connection)->scheduled, false);
+    pool_insert(dsp->pool, *connection);
+    return NULL;
+}
+
+dsp_error net_connect (struct dsp *dsp, char *address,
+        unsigned char const *public_key, struct connection **connection)
+{
+    dsp_error err;
+    // Attempts are told apart by the peer's key as well as its address, so
+    //  that a caller never picks up a connection to another node
+    unsigned char key[MAX_FLIGHT_KEY_LENGTH];
+    size_t length = strlen(address);
+    if (length >= ADDRESS_LENGTH)
+        return error(DSP_E_NETWORK, "Network address too long");
+    memcpy(key, public_key, PUBLIC_KEY_LENGTH);
+    memcpy(key + PUBLIC_KEY_LENGTH, address, length);
+    length += PUBLIC_KEY_LENGTH;
+    // Reuse a warm, authenticated connection if there is one.  Otherwise only
+    //  one caller connects, and concurrent callers pick up its connection.
+    while (!(*connection = pool_acquire(dsp->pool, address, public_key))) {
+        if (flight_begin(dsp->connects, key, length, NULL, 0, &err)) {
+            err = connect_new(dsp, address, public_key, connection);
+            flight_end(dsp->connects, key, length, NULL, 0, err);
+            return err;
+        }
+        if (err) return err;
     }
     return NULL;
 }
 
-dsp_error net_disconnect (struct connection *connection)
+dsp_error net_disconnect (struct dsp *dsp, struct connection *connection)
 {
+    pool_release(dsp->pool, connection);
     return NULL;
 }
+
+void net_send (struct connection *connection, struct request *request)
+{
+    // The request may be answered, and the connection closed, before this
+    //  returns
+    atomic_fetch_add(&connection->refs, 1);
+    queue_push(connection, request);
+    // Only the producer that finds the connection idle wakes its loop
+    if (!atomic_exchange(&connection->scheduled, true)) schedule(connection);
+    release(connection);
+}
+
+void net_close (struct connection *connection)
+{
+    atomic_store(&connection->closing, 1);
+    // The loop closes the connection, so a callback may release (and so
+    //  close) the connection it runs on
+    if (!atomic_exchange(&connection->scheduled, true)) schedule(connection);
+}
+
+dsp_error io_open (struct io **io, int num_threads)
+{
+    if (!(*io = calloc(1, sizeof(struct io))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate I/O pool");
+    if (!((*io)->loops = calloc(num_threads, sizeof(struct io_loop)))) {
+        free(*io);
+        *io = NULL;
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate I/O pool");
+    }
+    for (; (*io)->num_threads < num_threads; (*io)->num_threads++) {
+        struct io_loop *loop = &(*io)->loops[(*io)->num_threads];
+        dsp_error err = NULL;
+        if ((loop->epoll = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            err = sys_error(DSP_E_SYSTEM, errno, "Failed to create event loop");
+        } else if ((loop->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+                == -1) {
+            err = sys_error(DSP_E_SYSTEM, errno, "Failed to create event loop");
+            close(loop->epoll);
+        }
+        // The wakeup is registered without a connection
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+        if (!err && epoll_ctl(loop->epoll, EPOLL_CTL_ADD, loop->wakeup,
+                    &event)) {
+            err = sys_error(DSP_E_SYSTEM, errno, "Failed to register wakeup");
+            close(loop->wakeup);
+            close(loop->epoll);
+        }
+        if (!err) {
+            pthread_mutex_init(&loop->mutex, NULL);
+            int ret = pthread_create(&loop->thread, NULL, io_thread, loop);
+            if (ret) {
+                err = sys_error(DSP_E_SYSTEM, ret,
+                        "Failed to create I/O thread");
+                pthread_mutex_destroy(&loop->mutex);
+                close(loop->wakeup);
+                close(loop->epoll);
+            }
+        }
+        if (err) {
+            io_close(*io);
+            *io = NULL;
+            return err;
+        }
+    }
+    return NULL;
+}
+
+// Connections still open are not closed; pool_close closes them beforehand
+void io_close (struct io *io)
+{
+    for (int i = 0; i < io->num_threads; i++) {
+        struct io_loop *loop = &io->loops[i];
+        pthread_mutex_lock(&loop->mutex);
+        loop->stopping = true;
+        pthread_mutex_unlock(&loop->mutex);
+        uint64_t one = 1;
+        if (write(loop->wakeup, &one, sizeof(uint64_t)) == -1) {
+            // The counter cannot overflow, so the loop is already woken
+        }
+    }
+    for (int i = 0; i < io->num_threads; i++) {
+        struct io_loop *loop = &io->loops[i];
+        pthread_join(loop->thread, NULL);
+        pthread_mutex_destroy(&loop->mutex);
+        close(loop->wakeup);
+        close(loop->epoll);
+    }
+    free(io->loops);
+    free(io);
+}
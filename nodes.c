@@ -1,59 +1,434 @@
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "dsp.h"
 
-// Extern functions
+// Slots are indexed by a uint8_t in the LRU order
+static_assert(BUCKET_SIZE <= 256, "BUCKET_SIZE must fit in a byte");
+static_assert(!(INDEX_SIZE & (INDEX_SIZE - 1)),
+        "INDEX_SIZE must be a power of two");
+static_assert(INDEX_SIZE >= 2 * NUM_BUCKETS * BUCKET_SIZE,
+        "INDEX_SIZE must be at least twice the number of slots");
+static_assert(NUM_BUCKETS * BUCKET_SIZE < 0xffff,
+        "Slot numbers must fit in 16 bits");
+static_assert(HASH_LENGTH >= 2 * sizeof(uint64_t),
+        "The index hashes the last two words of a fingerprint");
+
+// Static functions
+
+// Sequence locks: a reader copies what it needs between read_begin and
+//  read_retry, and starts over if a writer intervened.
+static unsigned read_begin (atomic_uint *sequence)
+{
+    unsigned s;
+    while ((s = atomic_load_explicit(sequence, memory_order_acquire)) & 1);
+    return s;
+}
+
+static bool read_retry (atomic_uint *sequence, unsigned s)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(sequence, memory_order_relaxed) != s;
+}
+
+static void write_begin (atomic_uint *sequence)
+{
+    atomic_store_explicit(sequence,
+            atomic_load_explicit(sequence, memory_order_relaxed) + 1,
+            memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end (atomic_uint *sequence)
+{
+    atomic_store_explicit(sequence,
+            atomic_load_explicit(sequence, memory_order_relaxed) + 1,
+            memory_order_release);
+}
+
+static void lock_bucket (struct bucket *bucket)
+{
+    pthread_mutex_lock(&bucket->mutex);
+    write_begin(&bucket->sequence);
+}
+
+static void unlock_bucket (struct bucket *bucket)
+{
+    write_end(&bucket->sequence);
+    pthread_mutex_unlock(&bucket->mutex);
+}
+
+// Nodes in the deeper buckets share a long prefix with the host, and with each
+//  other, so the index hashes the trailing words of a fingerprint instead.
+//  Both are mixed by multiplication with a 64-bit odd constant, whose top bits
+//  give the probe position and the entry tag.
+static uint64_t mix_word (unsigned char const *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(uint64_t));
+    return word * 0x9e3779b97f4a7c15;
+}
+
+static size_t index_position (unsigned char const *fingerprint)
+{
+    return mix_word(fingerprint + HASH_LENGTH - sizeof(uint64_t))
+        >> (64 - __builtin_ctz(INDEX_SIZE));
+}
+
+static uint32_t index_tag (unsigned char const *fingerprint)
+{
+    return mix_word(fingerprint + HASH_LENGTH - 2 * sizeof(uint64_t)) >> 48
+        << 16;
+}
 
-void bump_node (struct node *node)
+static unsigned char *slot_fingerprint (struct nodes *nodes, int id)
 {
-    if (!node->previous) return;
-    node->previous->next = node->next;
-    if (node->next) node->next->previous = node->previous;
-    node->previous = NULL;
-    node->next = *node->bucket;
-    // Assert bucket is non-empty
-    assert(node->next);
-    node->next->previous = node;
-    *node->bucket = node;
+    return nodes->buckets[id / BUCKET_SIZE].fingerprint[id % BUCKET_SIZE];
 }
 
-struct node *return_node (struct hash *fingerprint, struct self *self)
+// index_find returns the index position holding the fingerprint, or the
+//  empty position where it would be inserted.
+static size_t index_find (struct nodes *nodes, unsigned char const *fingerprint)
 {
-    int i = hash_distance(key_fingerprint(keys_public_key(self->keys)),
-            fingerprint);
-    struct node *node = self->nodes->buckets[i];
-    while (node) {
-        if (!hash_distance(key_fingerprint(node->key), fingerprint))
-            return node;
-        node = node->next;
+    uint32_t tag = index_tag(fingerprint);
+    size_t i = index_position(fingerprint);
+    // The bound only matters to a reader racing a writer, which will retry
+    for (int n = 0; n < INDEX_SIZE; n++, i = (i + 1) & (INDEX_SIZE - 1)) {
+        uint32_t entry = nodes->index[i];
+        if (!entry) return i;
+        if ((entry & 0xffff0000) == tag && !memcmp(slot_fingerprint(nodes,
+                        (entry & 0xffff) - 1), fingerprint, HASH_LENGTH))
+            return i;
     }
-    return NULL;
+    return i;
 }
 
-struct node *closest_nodes (struct hash *hash, int limit, struct self *self)
+// Returns the slot number of the fingerprint, or -1 if it is not stored
+static int index_lookup (struct nodes *nodes, unsigned char const *fingerprint)
 {
-    int i = hash_distance(key_fingerprint(keys_public_key(self->keys)), hash);
-    struct node **array = calloc(limit + 1, sizeof(struct node *));
-    struct node *node = self->nodes->buckets[i];
-    for (int j = 0; j < limit;) {
-        if (node) {
-            array[j++] = node;
-            node = node->next;
-            continue;
+    uint32_t entry = nodes->index[index_find(nodes, fingerprint)];
+    return entry ? (int) (entry & 0xffff) - 1 : -1;
+}
+
+static void index_insert (struct nodes *nodes, unsigned char const *fingerprint,
+        int id)
+{
+    nodes->index[index_find(nodes, fingerprint)] = index_tag(fingerprint)
+        | (id + 1);
+}
+
+// Removes the entry by shifting back any later entries of its probe run, so
+//  that lookups never need tombstones
+static void index_remove (struct nodes *nodes, unsigned char const *fingerprint)
+{
+    size_t i = index_find(nodes, fingerprint);
+    if (!nodes->index[i]) return;
+    for (size_t j = (i + 1) & (INDEX_SIZE - 1); nodes->index[j];
+            j = (j + 1) & (INDEX_SIZE - 1)) {
+        size_t home = index_position(slot_fingerprint(nodes,
+                    (nodes->index[j] & 0xffff) - 1));
+        // The entry at j may fill the hole at i only if its home position
+        //  does not lie cyclically within (i, j]
+        if (((j - home) & (INDEX_SIZE - 1)) >= ((j - i) & (INDEX_SIZE - 1))) {
+            nodes->index[i] = nodes->index[j];
+            i = j;
         }
-        int offset = node->bucket - self->nodes->buckets - i;
-        offset = (offset >= 0) ? 0 - offset - 1 : 0 - offset;
-        if (i + offset < 0) {
-            if (i - offset > 8 * HASH_LENGTH - 1) return *array;
-            node = self->nodes->buckets[i - offset + 1];
-        } else if (i + offset > 8 * HASH_LENGTH - 1) {
-            if (i - offset == 0) return *array;
-            node = self->nodes->buckets[i - offset - 1];
+    }
+    nodes->index[i] = 0;
+}
+
+// Distance from the host to <fingerprint>
+static int host_distance (unsigned char const *fingerprint, struct dsp *dsp)
+{
+    return hash_distance(dsp->fingerprint, fingerprint);
+}
+
+static struct bucket *find_bucket (unsigned char const *fingerprint,
+        struct dsp *dsp)
+{
+    int d = host_distance(fingerprint, dsp);
+    // Distance 0 is the host itself
+    if (!d) return NULL;
+    return &dsp->nodes->buckets[d - 1];
+}
+
+// Moves the slot to the front of the bucket's LRU order
+static void bump_slot (struct bucket *bucket, int slot)
+{
+    int i = 0;
+    while (bucket->order[i] != slot) i++;
+    memmove(bucket->order + 1, bucket->order, i);
+    bucket->order[0] = slot;
+}
+
+static void copy_node (struct bucket *bucket, int slot, struct node *node)
+{
+    memcpy(node->fingerprint, bucket->fingerprint[slot], HASH_LENGTH);
+    memcpy(node->public_key, bucket->public_key[slot], PUBLIC_KEY_LENGTH);
+    memcpy(node->address, bucket->address[slot], ADDRESS_LENGTH);
+    node->rtt = bucket->rtt[slot];
+    node->deviation = bucket->deviation[slot];
+    node->failures = bucket->failures[slot];
+}
+
+// Returns the slot of a full bucket to give up for a new node, or -1 to keep
+//  them all.  Nodes that keep failing go first, then those never heard from,
+//  least recently contacted first.
+static int evict_slot (struct bucket *bucket)
+{
+    int victim = -1;
+    for (int i = BUCKET_SIZE - 1; i >= 0; i--) {
+        int slot = bucket->order[i];
+        if (bucket->failures[slot] && (victim < 0
+                    || bucket->failures[slot] > bucket->failures[victim]))
+            victim = slot;
+    }
+    if (victim >= 0) return victim;
+    for (int i = BUCKET_SIZE - 1; i >= 0; i--)
+        if (!bucket->rtt[bucket->order[i]]) return bucket->order[i];
+    return -1;
+}
+
+// Closest nodes are selected with a max-heap on distance to the target, so the
+//  farthest of the nodes selected so far is at the root.
+static void sift_down (struct node *heap, int n, int i,
+        unsigned char const *target)
+{
+    struct node node = heap[i];
+    while (2 * i + 1 < n) {
+        int c = 2 * i + 1;
+        if (c + 1 < n && hash_compare(target, heap[c + 1].fingerprint,
+                    heap[c].fingerprint) > 0)
+            c++;
+        if (hash_compare(target, heap[c].fingerprint, node.fingerprint) <= 0)
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = node;
+}
+
+static void sift_up (struct node *heap, int i, unsigned char const *target)
+{
+    struct node node = heap[i];
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (hash_compare(target, heap[p].fingerprint, node.fingerprint) >= 0)
+            break;
+        heap[i] = heap[p];
+        i = p;
+    }
+    heap[i] = node;
+}
+
+// Adds the bucket's nodes to the heap of the <k> closest.  Each slot is read
+//  consistently on its own; the rest of a node is only copied if it makes the
+//  heap.
+static void select_closest (struct bucket *bucket, unsigned char const *target,
+        struct node *heap, int *n, int k)
+{
+    for (int slot = 0;; slot++) {
+        struct node node;
+        bool end, take;
+        unsigned s;
+        do {
+            s = read_begin(&bucket->sequence);
+            if (end = slot >= bucket->count) continue;
+            memcpy(node.fingerprint, bucket->fingerprint[slot], HASH_LENGTH);
+            take = *n < k || hash_compare(target, node.fingerprint,
+                    heap[0].fingerprint) < 0;
+            if (take) {
+                memcpy(node.public_key, bucket->public_key[slot],
+                        PUBLIC_KEY_LENGTH);
+                memcpy(node.address, bucket->address[slot], ADDRESS_LENGTH);
+                node.rtt = bucket->rtt[slot];
+                node.deviation = bucket->deviation[slot];
+                node.failures = bucket->failures[slot];
+            }
+        } while (read_retry(&bucket->sequence, s));
+        if (end) return;
+        if (!take) continue;
+        if (*n < k) {
+            heap[*n] = node;
+            sift_up(heap, (*n)++, target);
         } else {
-            node = self->nodes->buckets[i + offset];
+            heap[0] = node;
+            sift_down(heap, k, 0, target);
         }
     }
-    return *array;
+}
+
+// Extern functions
+
+error nodes_open (struct nodes **nodes)
+{
+    if (!(*nodes = calloc(1, sizeof(struct nodes))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node table");
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        pthread_mutex_init(&(*nodes)->buckets[i].mutex, NULL);
+    pthread_mutex_init(&(*nodes)->mutex, NULL);
+    return NULL;
+}
+
+void nodes_close (struct nodes *nodes)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++)
+        pthread_mutex_destroy(&nodes->buckets[i].mutex);
+    pthread_mutex_destroy(&nodes->mutex);
+    free(nodes);
+}
+
+// Finds the slot number of the fingerprint without locking
+static int find_node (struct nodes *nodes, unsigned char const *fingerprint)
+{
+    int id;
+    unsigned s;
+    do {
+        s = read_begin(&nodes->sequence);
+        id = index_lookup(nodes, fingerprint);
+    } while (read_retry(&nodes->sequence, s));
+    return id;
+}
+
+void bump_node (struct hash *fingerprint, struct dsp *dsp)
+{
+    int id = find_node(dsp->nodes, fingerprint->hash);
+    if (id < 0) return;
+    struct bucket *bucket = &dsp->nodes->buckets[id / BUCKET_SIZE];
+    int slot = id % BUCKET_SIZE;
+    lock_bucket(bucket);
+    // The slot may have been reused since the index was read
+    if (!memcmp(bucket->fingerprint[slot], fingerprint->hash, HASH_LENGTH))
+        bump_slot(bucket, slot);
+    unlock_bucket(bucket);
+}
+
+void report_exchange (struct hash *fingerprint, bool ok, double rtt,
+        struct dsp *dsp)
+{
+    int id = find_node(dsp->nodes, fingerprint->hash);
+    if (id < 0) return;
+    struct bucket *bucket = &dsp->nodes->buckets[id / BUCKET_SIZE];
+    int slot = id % BUCKET_SIZE;
+    lock_bucket(bucket);
+    // The slot may have been reused since the index was read
+    if (!memcmp(bucket->fingerprint[slot], fingerprint->hash, HASH_LENGTH)) {
+        if (ok) {
+            // As TCP estimates its retransmission timeout (RFC 6298)
+            float *smoothed = &bucket->rtt[slot];
+            float *deviation = &bucket->deviation[slot];
+            if (*smoothed) {
+                *deviation += (fabs(rtt - *smoothed) - *deviation)
+                    / RTT_DEVIATION_GAIN;
+                *smoothed += (rtt - *smoothed) / RTT_GAIN;
+            } else {
+                *smoothed = rtt;
+                *deviation = rtt / 2;
+            }
+            // A zero round trip would read as never measured
+            if (!*smoothed) *smoothed = 1e-6;
+            bucket->failures[slot] = 0;
+            bump_slot(bucket, slot);
+        } else if (bucket->failures[slot] < UINT16_MAX) {
+            bucket->failures[slot]++;
+        }
+    }
+    unlock_bucket(bucket);
+}
+
+void add_node (struct node *node, struct dsp *dsp)
+{
+    struct nodes *nodes = dsp->nodes;
+    struct bucket *bucket = find_bucket(node->fingerprint, dsp);
+    if (!bucket) return;
+    int b = bucket - nodes->buckets;
+    lock_bucket(bucket);
+    // The node can only live in this bucket, but writers to other buckets may
+    //  be moving index entries
+    int slot, id = find_node(nodes, node->fingerprint);
+    bool changed = id < 0;
+    if (id >= 0) {
+        slot = id % BUCKET_SIZE;
+        changed = memcmp(bucket->public_key[slot], node->public_key,
+                PUBLIC_KEY_LENGTH) || strncmp(bucket->address[slot],
+                node->address, ADDRESS_LENGTH);
+    } else {
+        bool replace = bucket->count == BUCKET_SIZE;
+        if (!replace) {
+            slot = bucket->count;
+            bucket->order[bucket->count++] = slot;
+        } else if ((slot = evict_slot(bucket)) < 0) {
+            unlock_bucket(bucket);
+            return;
+        }
+        pthread_mutex_lock(&nodes->mutex);
+        write_begin(&nodes->sequence);
+        if (replace) index_remove(nodes, bucket->fingerprint[slot]);
+        memcpy(bucket->fingerprint[slot], node->fingerprint, HASH_LENGTH);
+        index_insert(nodes, node->fingerprint, b * BUCKET_SIZE + slot);
+        write_end(&nodes->sequence);
+        pthread_mutex_unlock(&nodes->mutex);
+        bucket->rtt[slot] = bucket->deviation[slot] = 0;
+        bucket->failures[slot] = 0;
+    }
+    memcpy(bucket->public_key[slot], node->public_key, PUBLIC_KEY_LENGTH);
+    memcpy(bucket->address[slot], node->address, ADDRESS_LENGTH);
+    bump_slot(bucket, slot);
+    unlock_bucket(bucket);
+    if (!changed) return;
+    error err = insert_node(dsp->db, node);
+    if (err) {
+        log_error(err);
+        dsp_error_free(err);
+    }
+}
+
+bool return_node (struct hash *fingerprint, struct dsp *dsp,
+        struct node *node)
+{
+    while (1) {
+        int id = find_node(dsp->nodes, fingerprint->hash);
+        if (id < 0) return false;
+        struct bucket *bucket = &dsp->nodes->buckets[id / BUCKET_SIZE];
+        unsigned s;
+        do {
+            s = read_begin(&bucket->sequence);
+            copy_node(bucket, id % BUCKET_SIZE, node);
+        } while (read_retry(&bucket->sequence, s));
+        // The slot may have been reused since the index was read
+        if (!memcmp(node->fingerprint, fingerprint->hash, HASH_LENGTH))
+            return true;
+    }
+}
+
+int closest_nodes (struct hash *hash, int k, struct dsp *dsp,
+        struct node *nodes)
+{
+    if (k <= 0) return 0;
+    unsigned char const *target = hash->hash;
+    // Bucket of the target, or -1 for the host itself
+    int t = host_distance(target, dsp) - 1;
+    int n = 0;
+    // Relative to the target, nodes in bucket t are closer than those in
+    //  buckets below t, which are all closer than any node in bucket t + 1,
+    //  and so on outward.  Selection can stop at the first group boundary
+    //  with k nodes found.
+    if (t >= 0) {
+        select_closest(&dsp->nodes->buckets[t], target, nodes, &n, k);
+        for (int b = 0; b < t; b++)
+            select_closest(&dsp->nodes->buckets[b], target, nodes, &n, k);
+    }
+    for (int b = t + 1; b < NUM_BUCKETS && n < k; b++)
+        select_closest(&dsp->nodes->buckets[b], target, nodes, &n, k);
+    // Sort the heap in place, closest first
+    for (int i = n - 1; i > 0; i--) {
+        struct node node = nodes[0];
+        nodes[0] = nodes[i];
+        nodes[i] = node;
+        sift_down(nodes, i, 0, target);
+    }
+    return n;
 }
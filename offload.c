@@ -0,0 +1,106 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dsp.h"
+
+// Jobs are queued on a single list, and taken by the workers up to
+//  OFFLOAD_BATCH at a time, so that the mutex is taken once per batch rather
+//  than once per job.
+struct offload {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct job *head;
+    struct job *tail;
+    bool stopping;
+    int num_threads;
+    pthread_t *threads;
+};
+
+/// Static functions
+
+static void *work (void *arg)
+{
+    struct offload *offload = arg;
+    pthread_mutex_lock(&offload->mutex);
+    while (1) {
+        while (!offload->head && !offload->stopping)
+            pthread_cond_wait(&offload->cond, &offload->mutex);
+        // Queued jobs are run before stopping
+        if (!offload->head) break;
+        struct job *batch = offload->head, *last = batch;
+        for (int n = 1; n < OFFLOAD_BATCH && last->next; n++)
+            last = last->next;
+        if (!(offload->head = last->next)) offload->tail = NULL;
+        last->next = NULL;
+        pthread_mutex_unlock(&offload->mutex);
+        for (struct job *job = batch; job; job = job->next) job->run(job);
+        // A completed job belongs to its owner again, and its link with it
+        while (batch) {
+            struct job *next = batch->next;
+            batch->done(batch);
+            batch = next;
+        }
+        pthread_mutex_lock(&offload->mutex);
+    }
+    pthread_mutex_unlock(&offload->mutex);
+    return NULL;
+}
+
+/// Extern functions
+
+error offload_open (struct offload **offload, int num_threads)
+{
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+    if (!(*offload = calloc(1, sizeof(struct offload))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate offload");
+    if (!((*offload)->threads = calloc(num_threads, sizeof(pthread_t)))) {
+        free(*offload);
+        *offload = NULL;
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate offload");
+    }
+    pthread_mutex_init(&(*offload)->mutex, NULL);
+    pthread_cond_init(&(*offload)->cond, NULL);
+    for (; (*offload)->num_threads < num_threads; (*offload)->num_threads++) {
+        int ret = pthread_create(&(*offload)->threads[(*offload)->num_threads],
+                NULL, work, *offload);
+        if (ret) {
+            offload_close(*offload);
+            *offload = NULL;
+            return sys_error(DSP_E_SYSTEM, ret,
+                    "Failed to create crypto worker");
+        }
+    }
+    return NULL;
+}
+
+void offload_close (struct offload *offload)
+{
+    pthread_mutex_lock(&offload->mutex);
+    offload->stopping = true;
+    pthread_cond_broadcast(&offload->cond);
+    pthread_mutex_unlock(&offload->mutex);
+    for (int i = 0; i < offload->num_threads; i++)
+        pthread_join(offload->threads[i], NULL);
+    pthread_cond_destroy(&offload->cond);
+    pthread_mutex_destroy(&offload->mutex);
+    free(offload->threads);
+    free(offload);
+}
+
+void offload_submit (struct offload *offload, struct job *first,
+        struct job *last)
+{
+    last->next = NULL;
+    pthread_mutex_lock(&offload->mutex);
+    if (offload->tail) offload->tail->next = first;
+    else offload->head = first;
+    offload->tail = last;
+    // A single job needs a single worker
+    if (first == last) pthread_cond_signal(&offload->cond);
+    else pthread_cond_broadcast(&offload->cond);
+    pthread_mutex_unlock(&offload->mutex);
+}
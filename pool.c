@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+
+// The pool indexes open connections by address in a chained hash table.  A
+//  connection is only handed out for the key its peer authenticated with, as
+//  another node may have taken over the address.  Idle connections (those with
+//  no users) are also kept on a doubly-linked list in least-recently-used
+//  order, and are closed from its tail once more than <capacity> connections
+//  are open.  Failed connections are closed as soon as their last user
+//  releases them.
+struct pool {
+    pthread_mutex_t mutex;
+    // Signaled when a closing pool's last busy connection is released
+    pthread_cond_t released;
+    int capacity;
+    int count;
+    // Number of connections with users
+    int busy;
+    bool closing;
+    size_t num_chains;
+    struct connection **chains;
+    // Idle list, most recently released first
+    struct connection *head;
+    struct connection *tail;
+};
+
+/// Static functions
+
+// FNV-1a
+static size_t hash_address (char const *address)
+{
+    uint64_t h = 0xcbf29ce484222325;
+    for (; *address; address++) {
+        h ^= (unsigned char) *address;
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+static void unlink_idle (struct pool *pool, struct connection *conn)
+{
+    if (conn->previous) conn->previous->next = conn->next;
+    else pool->head = conn->next;
+    if (conn->next) conn->next->previous = conn->previous;
+    else pool->tail = conn->previous;
+    conn->previous = conn->next = NULL;
+}
+
+static void unlink_chain (struct pool *pool, struct connection *conn)
+{
+    struct connection **p = &pool->chains[hash_address(conn->address)
+            & (pool->num_chains - 1)];
+    while (*p != conn) p = &(*p)->chain;
+    *p = conn->chain;
+    conn->chain = NULL;
+    pool->count--;
+}
+
+// evict removes idle connections from the tail of the LRU list until the pool
+//  is within capacity.  Evicted connections are returned as a list linked by
+//  their chain pointers, so they can be closed outside the pool mutex.
+static struct connection *evict (struct pool *pool)
+{
+    struct connection *evicted = NULL;
+    while (pool->count > pool->capacity && pool->tail) {
+        struct connection *conn = pool->tail;
+        unlink_idle(pool, conn);
+        unlink_chain(pool, conn);
+        conn->chain = evicted;
+        evicted = conn;
+    }
+    return evicted;
+}
+
+static void close_evicted (struct connection *evicted)
+{
+    while (evicted) {
+        struct connection *next = evicted->chain;
+        net_close(evicted);
+        evicted = next;
+    }
+}
+
+/// Extern functions
+
+dsp_error pool_open (struct pool **pool, int capacity)
+{
+    assert(capacity > 0);
+    if (!(*pool = calloc(1, sizeof(struct pool))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate pool");
+    (*pool)->capacity = capacity;
+    // Power of two no smaller than the capacity
+    for ((*pool)->num_chains = 1; (*pool)->num_chains < capacity;
+            (*pool)->num_chains <<= 1);
+    if (!((*pool)->chains = calloc((*pool)->num_chains,
+                    sizeof(struct connection *)))) {
+        free(*pool);
+        *pool = NULL;
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate pool");
+    }
+    int ret = pthread_mutex_init(&(*pool)->mutex, NULL);
+    if (!ret && (ret = pthread_cond_init(&(*pool)->released, NULL)))
+        pthread_mutex_destroy(&(*pool)->mutex);
+    if (ret) {
+        free((*pool)->chains);
+        free(*pool);
+        *pool = NULL;
+        return sys_error(DSP_E_SYSTEM, ret, "Failed to initialize pool");
+    }
+    return NULL;
+}
+
+// Requests still in flight fail once their connections are closed, and their
+//  callbacks release the connections; the pool is freed only after the last
+//  of them, as each release still takes the pool mutex
+void pool_close (struct pool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    pool->closing = true;
+    for (size_t i = 0; i < pool->num_chains; i++) {
+        struct connection *conn = pool->chains[i];
+        while (conn) {
+            struct connection *next = conn->chain;
+            net_close(conn);
+            conn = next;
+        }
+    }
+    while (pool->busy) pthread_cond_wait(&pool->released, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_cond_destroy(&pool->released);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->chains);
+    free(pool);
+}
+
+struct connection *pool_acquire (struct pool *pool, char const *address,
+        unsigned char const *public_key)
+{
+    pthread_mutex_lock(&pool->mutex);
+    struct connection *conn = pool->chains[hash_address(address)
+            & (pool->num_chains - 1)];
+    while (conn && (strcmp(conn->address, address)
+                || memcmp(conn->public_key, public_key, PUBLIC_KEY_LENGTH)
+                || atomic_load(&conn->failed)))
+        conn = conn->chain;
+    if (conn) {
+        if (!conn->users) {
+            unlink_idle(pool, conn);
+            pool->busy++;
+        }
+        conn->users++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return conn;
+}
+
+void pool_insert (struct pool *pool, struct connection *conn)
+{
+    pthread_mutex_lock(&pool->mutex);
+    struct connection **chain = &pool->chains[hash_address(conn->address)
+            & (pool->num_chains - 1)];
+    conn->chain = *chain;
+    *chain = conn;
+    conn->previous = conn->next = NULL;
+    conn->users = 1;
+    pool->busy++;
+    pool->count++;
+    struct connection *evicted = evict(pool);
+    pthread_mutex_unlock(&pool->mutex);
+    close_evicted(evicted);
+}
+
+void pool_release (struct pool *pool, struct connection *conn)
+{
+    pthread_mutex_lock(&pool->mutex);
+    assert(conn->users > 0);
+    if (!--conn->users) pool->busy--;
+    // pool_close has closed every connection already
+    if (pool->closing) {
+        if (!pool->busy) pthread_cond_signal(&pool->released);
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+    struct connection *failed = NULL;
+    if (!conn->users && atomic_load(&conn->failed)) {
+        unlink_chain(pool, conn);
+        failed = conn;
+    } else if (!conn->users) {
+        conn->previous = NULL;
+        conn->next = pool->head;
+        if (pool->head) pool->head->previous = conn;
+        else pool->tail = conn;
+        pool->head = conn;
+    }
+    struct connection *evicted = evict(pool);
+    pthread_mutex_unlock(&pool->mutex);
+    if (failed) net_close(failed);
+    close_evicted(evicted);
+}
+
+void pool_remove (struct pool *pool, struct connection *conn)
+{
+    pthread_mutex_lock(&pool->mutex);
+    if (!conn->users) unlink_idle(pool, conn);
+    unlink_chain(pool, conn);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,546 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsp.h"
+
+// Maximum number of candidates a lookup keeps track of
+#define MAX_CANDIDATES (4 * LOOKUP_K)
+// Queries a lookup may have outstanding, counting hedges and the queries they
+//  stand in for
+#define MAX_QUERIES (2 * LOOKUP_ALPHA)
+// Number of recent round trips the hedging threshold is taken from
+#define RTT_SAMPLES 128
+// Round trips seen before the threshold replaces HEDGE_DELAY
+#define MIN_RTT_SAMPLES 16
+
+enum {
+    CANDIDATE_NEW,
+    CANDIDATE_WAITING,
+    CANDIDATE_ANSWERED,
+    CANDIDATE_FAILED
+};
+
+struct candidate {
+    struct node node;
+    int state;
+    // Number of referrals that led to the node; 1 for the host's own nodes
+    int hops;
+};
+
+// A query that is slow to answer is hedged by asking the next candidate as
+//  well.  The two are paired through <partner> until either completes; once
+//  one answers, the other is abandoned: the lookup no longer waits on it.
+struct query {
+    struct request request;
+    struct lookup *lookup;
+    struct connection *connection;
+    struct node node;           // the queried node
+    int hops;
+    bool busy;
+    struct timespec sent;       // when the query was started, connecting first
+    double threshold;           // seconds after which the query is hedged
+    bool hedged;                // a hedge was tried for the query
+    bool hedge;                 // the query is a hedge
+    bool abandoned;
+    struct query *partner;
+    unsigned char buffer[MSG_FIND_LENGTH];
+};
+
+// A lookup is driven by the calling thread, which sends queries and sleeps on
+//  <cond>.  Responses are folded in by the I/O threads' callbacks, which also
+//  release the queries' connections.  Everything is protected by <mutex>.  The
+//  lookup is freed by whichever of the caller and the callbacks of abandoned
+//  queries finishes with it last.
+struct lookup {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct dsp *dsp;
+    int refs;
+    unsigned char target[HASH_LENGTH];
+    // Delay before hedging a query to a node whose round trip is unknown
+    double threshold;
+    // Sorted by distance to the target
+    struct candidate candidates[MAX_CANDIDATES];
+    int count;
+    struct query queries[MAX_QUERIES];
+    int in_flight;              // busy queries
+    int pending;                // busy queries not abandoned
+    int answered;               // queries answered
+    bool found;
+    struct node result;
+    struct lookup_stats stats;
+};
+
+// Round trips of recent queries, across lookups, from which the delay before
+//  hedging a query to an unmeasured node is taken
+struct hedging {
+    pthread_mutex_t mutex;
+    double samples[RTT_SAMPLES];    // seconds, a ring buffer
+    int count;
+    int next;
+    double threshold;
+    struct hedging_stats stats;
+};
+
+/// Static functions
+
+static double seconds_since (struct timespec const *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int compare_doubles (void const *a, void const *b)
+{
+    double x = *(double const *) a, y = *(double const *) b;
+    return (x > y) - (x < y);
+}
+
+static void record_rtt (struct hedging *hedging, double rtt)
+{
+    pthread_mutex_lock(&hedging->mutex);
+    hedging->samples[hedging->next] = rtt;
+    hedging->next = (hedging->next + 1) % RTT_SAMPLES;
+    if (hedging->count < RTT_SAMPLES) hedging->count++;
+    // The percentile is refreshed every MIN_RTT_SAMPLES round trips
+    if (hedging->count >= MIN_RTT_SAMPLES
+            && !(hedging->next % MIN_RTT_SAMPLES)) {
+        double sorted[RTT_SAMPLES];
+        memcpy(sorted, hedging->samples, hedging->count * sizeof(double));
+        qsort(sorted, hedging->count, sizeof(double), compare_doubles);
+        hedging->threshold = sorted[(hedging->count - 1) * HEDGE_PERCENTILE
+            / 100];
+    }
+    pthread_mutex_unlock(&hedging->mutex);
+}
+
+static double hedge_threshold (struct hedging *hedging)
+{
+    pthread_mutex_lock(&hedging->mutex);
+    double threshold = hedging->count >= MIN_RTT_SAMPLES ?
+        hedging->threshold : HEDGE_DELAY / 1e3;
+    pthread_mutex_unlock(&hedging->mutex);
+    return threshold;
+}
+
+// Returns the position of the fingerprint among the candidates, or where it
+//  would be inserted
+static int search_candidates (struct lookup *lookup,
+        unsigned char const *fingerprint, bool *exists)
+{
+    int low = 0, high = lookup->count;
+    *exists = false;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        int c = hash_compare(lookup->target, fingerprint,
+                lookup->candidates[mid].node.fingerprint);
+        if (!c) {
+            *exists = true;
+            return mid;
+        }
+        if (c < 0) high = mid;
+        else low = mid + 1;
+    }
+    return low;
+}
+
+static struct candidate *find_candidate (struct lookup *lookup,
+        unsigned char const *fingerprint)
+{
+    bool exists;
+    int i = search_candidates(lookup, fingerprint, &exists);
+    return exists ? &lookup->candidates[i] : NULL;
+}
+
+static void add_candidate (struct lookup *lookup, struct node *node, int hops)
+{
+    if (!memcmp(node->fingerprint, lookup->dsp->fingerprint, HASH_LENGTH))
+        return;
+    bool exists;
+    int i = search_candidates(lookup, node->fingerprint, &exists);
+    if (exists || i == MAX_CANDIDATES) return;
+    // Make room by dropping the farthest candidate
+    if (lookup->count == MAX_CANDIDATES) lookup->count--;
+    memmove(&lookup->candidates[i + 1], &lookup->candidates[i],
+            (lookup->count - i) * sizeof(struct candidate));
+    lookup->count++;
+    lookup->candidates[i].node = *node;
+    lookup->candidates[i].state = CANDIDATE_NEW;
+    lookup->candidates[i].hops = hops;
+}
+
+// Whether candidate <a> is to be asked before <b> at the same distance: the
+//  one with the lower round trip, as measured by the host, if any
+static bool faster (struct candidate *a, struct candidate *b)
+{
+    if (!a->node.rtt || a->node.failures > b->node.failures) return false;
+    return !b->node.rtt || a->node.failures < b->node.failures
+        || a->node.rtt < b->node.rtt;
+}
+
+// Returns the closest candidate not yet queried, among the LOOKUP_K closest
+//  that have not failed.  Of the candidates at the same distance (that is,
+//  with the same highest differing bit from the target), the fastest is
+//  preferred.
+static struct candidate *next_candidate (struct lookup *lookup)
+{
+    struct candidate *next = NULL;
+    int distance;
+    for (int i = 0, k = 0; i < lookup->count && k < LOOKUP_K; i++) {
+        struct candidate *candidate = &lookup->candidates[i];
+        if (candidate->state == CANDIDATE_FAILED) continue;
+        k++;
+        if (next && hash_distance(lookup->target,
+                    candidate->node.fingerprint) != distance)
+            break;
+        if (candidate->state != CANDIDATE_NEW) continue;
+        if (!next) {
+            next = candidate;
+            distance = hash_distance(lookup->target,
+                    candidate->node.fingerprint);
+        } else if (faster(candidate, next)) {
+            next = candidate;
+        }
+    }
+    return next;
+}
+
+static void free_lookup (struct lookup *lookup)
+{
+    pthread_cond_destroy(&lookup->cond);
+    pthread_mutex_destroy(&lookup->mutex);
+    free(lookup);
+}
+
+// Called with the mutex held
+static void abandon (struct lookup *lookup, struct query *query)
+{
+    query->abandoned = true;
+    lookup->pending--;
+}
+
+// Called with the mutex held
+static void end_query (struct lookup *lookup, struct query *query)
+{
+    if (query->partner) query->partner->partner = NULL;
+    query->partner = NULL;
+    if (!query->abandoned) lookup->pending--;
+    lookup->in_flight--;
+    query->busy = false;
+}
+
+static void on_response (struct request *request, dsp_error err)
+{
+    struct query *query = request->arg;
+    struct lookup *lookup = query->lookup;
+    struct dsp *dsp = lookup->dsp;
+    struct connection *connection = query->connection;
+    // The round trip runs from when the I/O thread wrote the request, and
+    //  leaves out connecting and any handshake
+    double rtt = seconds_since(&request->sent);
+    struct node nodes[LOOKUP_K];
+    int n = LOOKUP_K;
+    if (!err) err = msg_parse_found(request->response,
+            request->response_length, nodes, &n);
+    free(request->response);
+    request->response = NULL;
+    bool answered = !err;
+    // A node that answers has proven its key at its address, as connections
+    //  are only shared between requests to the same key, and joins the
+    //  routing table.  Referred nodes only join once they answer in turn.
+    if (answered) add_node(&query->node, dsp);
+    report_exchange((struct hash *) query->node.fingerprint, answered, rtt,
+            dsp);
+    if (answered) for (int i = 0; i < n;) {
+        // A referral whose fingerprint is not that of its key could not be
+        //  told apart from the node it claims to be, and is dropped
+        unsigned char derived[HASH_LENGTH];
+        fingerprint(nodes[i].public_key, derived);
+        if (memcmp(derived, nodes[i].fingerprint, HASH_LENGTH)) {
+            nodes[i] = nodes[--n];
+            continue;
+        }
+        // A referral to a known node is taken as the host knows it, so that
+        //  the referrer cannot send queries for it to another address, and it
+        //  is ranked by the host's own measurements
+        return_node((struct hash *) nodes[i].fingerprint, dsp, &nodes[i]);
+        i++;
+    }
+    pthread_mutex_lock(&lookup->mutex);
+    // The candidate may have been pushed out by closer ones
+    struct candidate *candidate = find_candidate(lookup,
+            query->node.fingerprint);
+    if (err) {
+        if (candidate) candidate->state = CANDIDATE_FAILED;
+        dsp_error_free(err);
+    } else {
+        if (candidate) candidate->state = CANDIDATE_ANSWERED;
+        lookup->answered++;
+        if (query->hops > lookup->stats.hops) lookup->stats.hops = query->hops;
+        for (int i = 0; i < n; i++) {
+            if (!lookup->found && !memcmp(nodes[i].fingerprint,
+                        lookup->target, HASH_LENGTH)) {
+                lookup->found = true;
+                lookup->result = nodes[i];
+            }
+            add_candidate(lookup, &nodes[i], query->hops + 1);
+        }
+        // Whichever of a hedged pair answers first stands for both
+        if (query->partner) {
+            if (query->hedge) {
+                lookup->stats.hedges_won++;
+                pthread_mutex_lock(&dsp->hedging->mutex);
+                dsp->hedging->stats.won++;
+                pthread_mutex_unlock(&dsp->hedging->mutex);
+            }
+            abandon(lookup, query->partner);
+        }
+    }
+    end_query(lookup, query);
+    bool last = !--lookup->refs;
+    pthread_cond_signal(&lookup->cond);
+    pthread_mutex_unlock(&lookup->mutex);
+    if (answered) record_rtt(dsp->hedging, rtt);
+    net_disconnect(dsp, connection);
+    if (last) free_lookup(lookup);
+}
+
+// Queries the candidate, as a hedge for <straggler> unless it is NULL.
+//  Called with the mutex held, which is dropped while connecting.
+static void send_query (struct lookup *lookup, struct candidate *candidate,
+        struct query *straggler)
+{
+    struct query *query = lookup->queries;
+    while (query->busy) query++;
+    query->busy = true;
+    query->lookup = lookup;
+    query->hops = candidate->hops;
+    query->hedged = query->abandoned = false;
+    query->hedge = straggler;
+    if (query->partner = straggler) straggler->partner = query;
+    clock_gettime(CLOCK_MONOTONIC, &query->sent);
+    query->node = candidate->node;
+    // A node is judged against its own round trips once it has some
+    query->threshold = query->node.rtt ? query->node.rtt + HEDGE_DEVIATIONS
+        * query->node.deviation : lookup->threshold;
+    // Every candidate is already known, and need not be sent back
+    unsigned char filter[BLOOM_LENGTH] = {0};
+    bloom_add(filter, lookup->dsp->fingerprint);
+    for (int i = 0; i < lookup->count; i++)
+        bloom_add(filter, lookup->candidates[i].node.fingerprint);
+    candidate->state = CANDIDATE_WAITING;
+    lookup->in_flight++;
+    lookup->pending++;
+    pthread_mutex_unlock(&lookup->mutex);
+    dsp_error err = net_connect(lookup->dsp, query->node.address,
+            query->node.public_key, &query->connection);
+    if (err) report_exchange((struct hash *) query->node.fingerprint, false, 0,
+            lookup->dsp);
+    pthread_mutex_lock(&lookup->mutex);
+    if (!err) {
+        memset(&query->request, 0, sizeof(struct request));
+        query->request.buffer = query->buffer;
+        query->request.length = msg_find(query->buffer, lookup->target,
+                filter);
+        query->request.callback = on_response;
+        query->request.arg = query;
+        lookup->refs++;
+        lookup->stats.messages++;
+        if (straggler) {
+            lookup->stats.hedges++;
+            pthread_mutex_lock(&lookup->dsp->hedging->mutex);
+            lookup->dsp->hedging->stats.sent++;
+            pthread_mutex_unlock(&lookup->dsp->hedging->mutex);
+        }
+        net_send(query->connection, &query->request);
+        return;
+    }
+    dsp_error_free(err);
+    if (candidate = find_candidate(lookup, query->node.fingerprint))
+        candidate->state = CANDIDATE_FAILED;
+    end_query(lookup, query);
+}
+
+// Returns the outstanding query that is due to be hedged first, and sets
+//  <deadline> to when.  Called with the mutex held.
+static struct query *next_straggler (struct lookup *lookup,
+        struct timespec *deadline)
+{
+    struct query *straggler = NULL;
+    for (int i = 0; i < MAX_QUERIES; i++) {
+        struct query *query = &lookup->queries[i];
+        if (!query->busy || query->abandoned || query->hedged || query->hedge)
+            continue;
+        long nanoseconds = query->threshold * 1e9;
+        struct timespec due = {query->sent.tv_sec + nanoseconds / 1000000000,
+            query->sent.tv_nsec + nanoseconds % 1000000000};
+        if (due.tv_nsec >= 1000000000) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+        if (!straggler || due.tv_sec < deadline->tv_sec
+                || (due.tv_sec == deadline->tv_sec
+                    && due.tv_nsec < deadline->tv_nsec)) {
+            straggler = query;
+            *deadline = due;
+        }
+    }
+    return straggler;
+}
+
+// settled returns whether the LOOKUP_K closest candidates have all answered,
+//  so that a node not found is known not to be on the network
+static bool settled (struct lookup *lookup)
+{
+    for (int i = 0; i < lookup->count && i < LOOKUP_K; i++)
+        if (lookup->candidates[i].state != CANDIDATE_ANSWERED) return false;
+    return true;
+}
+
+// search runs a lookup on the network.  It fails if no node answered, and
+//  sets <conclusive> when the node is found, or its absence is settled.
+static dsp_error search (struct dsp *dsp, struct hash *fingerprint,
+        struct node **node, bool *conclusive, struct lookup_stats *stats)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *node = NULL;
+    *conclusive = false;
+    struct lookup *lookup = calloc(1, sizeof(struct lookup));
+    if (!lookup) return sys_error(DSP_E_SYSTEM, errno,
+            "Failed to allocate lookup");
+    pthread_mutex_init(&lookup->mutex, NULL);
+    // Hedging deadlines are on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&lookup->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    lookup->dsp = dsp;
+    lookup->refs = 1;
+    memcpy(lookup->target, fingerprint->hash, HASH_LENGTH);
+    lookup->threshold = hedge_threshold(dsp->hedging);
+    // Start from the closest nodes in the routing table
+    struct node nodes[LOOKUP_K];
+    int n = closest_nodes(fingerprint, LOOKUP_K, dsp, nodes);
+    for (int i = 0; i < n; i++) {
+        if (!memcmp(nodes[i].fingerprint, lookup->target, HASH_LENGTH)) {
+            lookup->found = true;
+            lookup->result = nodes[i];
+        }
+        add_candidate(lookup, &nodes[i], 1);
+    }
+    pthread_mutex_lock(&lookup->mutex);
+    while (!lookup->found) {
+        struct candidate *candidate = next_candidate(lookup);
+        if (candidate && lookup->pending < LOOKUP_ALPHA
+                && lookup->in_flight < MAX_QUERIES) {
+            send_query(lookup, candidate, NULL);
+            continue;
+        }
+        // With nothing left to ask, the closest candidates have all answered
+        if (!lookup->pending) break;
+        struct timespec deadline;
+        struct query *straggler = next_straggler(lookup, &deadline);
+        if (!straggler) {
+            pthread_cond_wait(&lookup->cond, &lookup->mutex);
+            continue;
+        }
+        if (pthread_cond_timedwait(&lookup->cond, &lookup->mutex, &deadline)
+                != ETIMEDOUT)
+            continue;
+        // The straggler may have answered meanwhile
+        if (!straggler->busy || straggler->abandoned || straggler->hedged)
+            continue;
+        straggler->hedged = true;
+        if ((candidate = next_candidate(lookup))
+                && lookup->in_flight < MAX_QUERIES)
+            send_query(lookup, candidate, straggler);
+    }
+    // Abandoned queries are not waited on; their callbacks release the lookup
+    dsp_error err = NULL;
+    *conclusive = lookup->found || settled(lookup);
+    if (lookup->found) {
+        if (*node = malloc(sizeof(struct node))) **node = lookup->result;
+        else err = sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node");
+    } else if (!lookup->answered) {
+        // Either the routing table is empty, or every query failed
+        err = error(DSP_E_NETWORK, "Lookup failed: no node answered");
+    }
+    lookup->stats.seconds = seconds_since(&start);
+    if (stats) *stats = lookup->stats;
+    bool last = !--lookup->refs;
+    pthread_mutex_unlock(&lookup->mutex);
+    if (last) free_lookup(lookup);
+    return err;
+}
+
+/// Extern functions
+
+dsp_error hedging_open (struct hedging **hedging)
+{
+    if (!(*hedging = calloc(1, sizeof(struct hedging))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate hedging");
+    pthread_mutex_init(&(*hedging)->mutex, NULL);
+    return NULL;
+}
+
+void hedging_close (struct hedging *hedging)
+{
+    pthread_mutex_destroy(&hedging->mutex);
+    free(hedging);
+}
+
+void hedging_stats (struct hedging *hedging, struct hedging_stats *stats)
+{
+    pthread_mutex_lock(&hedging->mutex);
+    *stats = hedging->stats;
+    pthread_mutex_unlock(&hedging->mutex);
+}
+
+dsp_error lookup (struct dsp *dsp, struct hash *fingerprint, struct node **node,
+        struct lookup_stats *stats)
+{
+    struct node cached;
+    switch (cache_get(dsp->cache, fingerprint->hash, &cached)) {
+    case CACHE_FOUND:
+        if (!(*node = malloc(sizeof(struct node))))
+            return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node");
+        **node = cached;
+        if (stats) memset(stats, 0, sizeof(struct lookup_stats));
+        return NULL;
+    case CACHE_NOT_FOUND:
+        *node = NULL;
+        if (stats) memset(stats, 0, sizeof(struct lookup_stats));
+        return NULL;
+    }
+    struct {
+        bool found;
+        struct node node;
+    } outcome;
+    dsp_error err;
+    if (!flight_begin(dsp->lookups, fingerprint->hash, HASH_LENGTH, &outcome,
+                sizeof(outcome), &err)) {
+        // Another caller searched on our behalf
+        *node = NULL;
+        if (stats) memset(stats, 0, sizeof(struct lookup_stats));
+        if (err || !outcome.found) return err;
+        if (!(*node = malloc(sizeof(struct node))))
+            return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate node");
+        **node = outcome.node;
+        return NULL;
+    }
+    bool conclusive;
+    err = search(dsp, fingerprint, node, &conclusive, stats);
+    // Failed lookups, and misses while some of the closest nodes did not
+    //  answer, say nothing about the node, and are not cached
+    if (!err && conclusive) cache_put(dsp->cache, fingerprint->hash, *node);
+    if (outcome.found = *node) outcome.node = **node;
+    flight_end(dsp->lookups, fingerprint->hash, HASH_LENGTH, &outcome,
+            sizeof(outcome), err);
+    return err;
+}
@@ -0,0 +1,186 @@
+#include <endian.h>
+#include <errno.h>
+#include <nacl/crypto_box.h>
+#include <nacl/randombytes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsp.h"
+
+// Tickets are kept by the peer's public key in a direct-mapped table: a
+//  peer's ticket replaces whichever shared its entry.
+struct entry {
+    unsigned char peer[PUBLIC_KEY_LENGTH];
+    time_t expires;                 // 0 when the entry is empty
+    struct ticket ticket;
+};
+
+struct sessions {
+    pthread_mutex_t mutex;
+    struct entry entries[SESSION_CACHE_SIZE];
+};
+
+/// Static functions
+
+static time_t now (clockid_t clock)
+{
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec;
+}
+
+static struct entry *entry_of (struct sessions *sessions,
+        unsigned char const *peer)
+{
+    uint32_t h;
+    memcpy(&h, peer, sizeof(uint32_t));
+    return &sessions->entries[h % SESSION_CACHE_SIZE];
+}
+
+// Tickets outlive the server's uptime, so their expiry is in wall-clock time
+static void issue_ticket (struct dsp *dsp, unsigned char const *key,
+        unsigned char const *peer, unsigned char *ticket)
+{
+    unsigned char contents[SESSION_KEY_LENGTH + PUBLIC_KEY_LENGTH + 8];
+    memcpy(contents, key, SESSION_KEY_LENGTH);
+    memcpy(contents + SESSION_KEY_LENGTH, peer, PUBLIC_KEY_LENGTH);
+    uint64_t expires = htobe64(now(CLOCK_REALTIME) + SESSION_TTL);
+    memcpy(contents + SESSION_KEY_LENGTH + PUBLIC_KEY_LENGTH, &expires, 8);
+    randombytes(ticket, NONCE_LENGTH);
+    seal(ticket + NONCE_LENGTH, contents, sizeof(contents), ticket,
+            dsp->ticket_key);
+}
+
+/// Extern functions
+
+error sessions_open (struct sessions **sessions)
+{
+    if (!(*sessions = calloc(1, sizeof(struct sessions))))
+        return sys_error(DSP_E_SYSTEM, errno, "Failed to allocate sessions");
+    pthread_mutex_init(&(*sessions)->mutex, NULL);
+    return NULL;
+}
+
+void sessions_close (struct sessions *sessions)
+{
+    pthread_mutex_destroy(&sessions->mutex);
+    free(sessions);
+}
+
+bool session_find (struct sessions *sessions, unsigned char const *peer,
+        struct ticket *ticket)
+{
+    pthread_mutex_lock(&sessions->mutex);
+    struct entry *entry = entry_of(sessions, peer);
+    bool found = entry->expires > now(CLOCK_MONOTONIC)
+        && !memcmp(entry->peer, peer, PUBLIC_KEY_LENGTH);
+    if (found) *ticket = entry->ticket;
+    pthread_mutex_unlock(&sessions->mutex);
+    return found;
+}
+
+void session_store (struct sessions *sessions, unsigned char const *peer,
+        struct ticket *ticket)
+{
+    pthread_mutex_lock(&sessions->mutex);
+    struct entry *entry = entry_of(sessions, peer);
+    memcpy(entry->peer, peer, PUBLIC_KEY_LENGTH);
+    entry->ticket = *ticket;
+    entry->expires = now(CLOCK_MONOTONIC) + SESSION_TTL;
+    pthread_mutex_unlock(&sessions->mutex);
+}
+
+void session_forget (struct sessions *sessions, unsigned char const *peer)
+{
+    pthread_mutex_lock(&sessions->mutex);
+    struct entry *entry = entry_of(sessions, peer);
+    if (!memcmp(entry->peer, peer, PUBLIC_KEY_LENGTH)) entry->expires = 0;
+    pthread_mutex_unlock(&sessions->mutex);
+}
+
+// Connection ids are random, so a session key resumed on many connections
+//  never sees the same nonce twice
+void session_nonce (unsigned char const *id, uint64_t counter, int direction,
+        unsigned char *nonce)
+{
+    memcpy(nonce, id, CONNECTION_ID_LENGTH);
+    uint64_t n = htobe64(counter << 1 | direction);
+    memcpy(nonce + CONNECTION_ID_LENGTH, &n, sizeof(uint64_t));
+}
+
+void session_hello (struct dsp *dsp, unsigned char const *peer,
+        unsigned char const *id, unsigned char *secret, unsigned char *hello)
+{
+    unsigned char ephemeral[PUBLIC_KEY_LENGTH];
+    crypto_box_keypair(ephemeral, secret);
+    hello[0] = MSG_HELLO;
+    memcpy(hello + 1, dsp->public_key, PUBLIC_KEY_LENGTH);
+    memcpy(hello + 1 + PUBLIC_KEY_LENGTH, id, CONNECTION_ID_LENGTH);
+    unsigned char *nonce = hello + 1 + PUBLIC_KEY_LENGTH
+        + CONNECTION_ID_LENGTH;
+    randombytes(nonce, NONCE_LENGTH);
+    unsigned char key[SHARED_KEY_LENGTH];
+    shared_key(dsp, peer, key);
+    encrypt(nonce + NONCE_LENGTH, ephemeral, PUBLIC_KEY_LENGTH, nonce, key);
+}
+
+error session_welcomed (unsigned char const *peer, unsigned char const *secret,
+        unsigned char const *welcome, size_t length, struct ticket *ticket)
+{
+    if (length != MSG_WELCOME_LENGTH || welcome[0] != MSG_WELCOME)
+        return error(DSP_E_NETWORK, "Invalid welcome");
+    unsigned char contents[SESSION_KEY_LENGTH + TICKET_LENGTH];
+    // The ephemeral key is used once, and not worth caching
+    unsigned char key[SHARED_KEY_LENGTH];
+    precompute(key, peer, secret);
+    error err = decrypt(contents, welcome + 1 + NONCE_LENGTH,
+            length - 1 - NONCE_LENGTH, welcome + 1, key);
+    if (err) return err;
+    memcpy(ticket->key, contents, SESSION_KEY_LENGTH);
+    memcpy(ticket->ticket, contents + SESSION_KEY_LENGTH, TICKET_LENGTH);
+    return NULL;
+}
+
+error session_greet (struct dsp *dsp, unsigned char const *hello,
+        size_t length, unsigned char *id, unsigned char *key,
+        unsigned char *peer, unsigned char *welcome)
+{
+    if (length != MSG_HELLO_LENGTH || hello[0] != MSG_HELLO)
+        return error(DSP_E_NETWORK, "Invalid hello");
+    memcpy(peer, hello + 1, PUBLIC_KEY_LENGTH);
+    memcpy(id, hello + 1 + PUBLIC_KEY_LENGTH, CONNECTION_ID_LENGTH);
+    unsigned char const *nonce = hello + 1 + PUBLIC_KEY_LENGTH
+        + CONNECTION_ID_LENGTH;
+    unsigned char ephemeral[PUBLIC_KEY_LENGTH], shared[SHARED_KEY_LENGTH];
+    shared_key(dsp, peer, shared);
+    error err = decrypt(ephemeral, nonce + NONCE_LENGTH,
+            MAC_LENGTH + PUBLIC_KEY_LENGTH, nonce, shared);
+    if (err) return err;
+    unsigned char contents[SESSION_KEY_LENGTH + TICKET_LENGTH];
+    randombytes(key, SESSION_KEY_LENGTH);
+    memcpy(contents, key, SESSION_KEY_LENGTH);
+    issue_ticket(dsp, key, peer, contents + SESSION_KEY_LENGTH);
+    welcome[0] = MSG_WELCOME;
+    randombytes(welcome + 1, NONCE_LENGTH);
+    precompute(shared, ephemeral, dsp->private_key);
+    encrypt(welcome + 1 + NONCE_LENGTH, contents, sizeof(contents),
+            welcome + 1, shared);
+    return NULL;
+}
+
+error session_redeem (struct dsp *dsp, unsigned char const *ticket,
+        unsigned char *key, unsigned char *peer)
+{
+    unsigned char contents[SESSION_KEY_LENGTH + PUBLIC_KEY_LENGTH + 8];
+    error err = unseal(contents, ticket + NONCE_LENGTH,
+            TICKET_LENGTH - NONCE_LENGTH, ticket, dsp->ticket_key);
+    if (err) return err;
+    uint64_t expires;
+    memcpy(&expires, contents + SESSION_KEY_LENGTH + PUBLIC_KEY_LENGTH, 8);
+    if (be64toh(expires) <= (uint64_t) now(CLOCK_REALTIME))
+        return error(DSP_E_NODE_INVALID, "Session ticket expired");
+    memcpy(key, contents, SESSION_KEY_LENGTH);
+    memcpy(peer, contents + SESSION_KEY_LENGTH, PUBLIC_KEY_LENGTH);
+    return NULL;
+}
@@ -0,0 +1,333 @@
+#include <assert.h>
+#include <endian.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86
+#endif
+
+#include "dsp.h"
+
+static_assert(HASH_LENGTH == 32, "HASH_LENGTH must be that of SHA-256");
+
+#define BLOCK_LENGTH 64
+// Number of messages hashed at once by the multi-buffer kernel
+#define LANES 8
+
+static uint32_t const K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t const H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c,
+    0x1f83d9ab, 0x5be0cd19
+};
+
+// The compression function runs over whole blocks; the kernel is picked once,
+//  by what the processor supports
+static void (*compress) (uint32_t *state, unsigned char const *blocks,
+        size_t n);
+static bool multi_buffer;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/// Static functions
+
+static uint32_t load_be32 (unsigned char const *p)
+{
+    uint32_t word;
+    memcpy(&word, p, sizeof(uint32_t));
+    return be32toh(word);
+}
+
+static uint32_t rotr (uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+// The rounds are unrolled eight at a time, with the working variables renamed
+//  instead of shifted
+#define ROUND(a, b, c, d, e, f, g, h, t) do { \
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) \
+        + (e & f ^ ~e & g) + K[t] + w[t]; \
+    d += t1; \
+    h = t1 + (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) \
+        + (a & b ^ a & c ^ b & c); \
+} while (0)
+
+static void compress_scalar (uint32_t *state, unsigned char const *blocks,
+        size_t n)
+{
+    for (; n; n--, blocks += BLOCK_LENGTH) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; t++) w[t] = load_be32(blocks + 4 * t);
+        for (int t = 16; t < 64; t++) {
+            uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18)
+                ^ w[t - 15] >> 3;
+            uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19)
+                ^ w[t - 2] >> 10;
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+            e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t += 8) {
+            ROUND(a, b, c, d, e, f, g, h, t);
+            ROUND(h, a, b, c, d, e, f, g, t + 1);
+            ROUND(g, h, a, b, c, d, e, f, t + 2);
+            ROUND(f, g, h, a, b, c, d, e, t + 3);
+            ROUND(e, f, g, h, a, b, c, d, t + 4);
+            ROUND(d, e, f, g, h, a, b, c, t + 5);
+            ROUND(c, d, e, f, g, h, a, b, t + 6);
+            ROUND(b, c, d, e, f, g, h, a, t + 7);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef X86
+// The SHA extensions keep the state as ABEF and CDGH, and run two rounds per
+//  instruction on four message words at a time
+#define ROUNDS4(w, i) do { \
+    __m128i m = _mm_add_epi32(w, \
+            _mm_loadu_si128((__m128i const *) (K + 4 * (i)))); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, m); \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(m, 0x0e)); \
+} while (0)
+// Replaces words t - 16 to t - 13 in <w0> with words t to t + 3
+#define SCHEDULE(w0, w1, w2, w3) w0 = _mm_sha256msg2_epu32(_mm_add_epi32( \
+            _mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3)
+
+__attribute__((target("sha,sse4.1")))
+static void compress_sha (uint32_t *state, unsigned char const *blocks,
+        size_t n)
+{
+    __m128i const swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+            0x0405060700010203ULL);
+    __m128i dcba = _mm_loadu_si128((__m128i const *) state);
+    __m128i hgfe = _mm_loadu_si128((__m128i const *) (state + 4));
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+    for (; n; n--, blocks += BLOCK_LENGTH) {
+        __m128i abef_saved = abef, cdgh_saved = cdgh;
+        __m128i w0 = _mm_shuffle_epi8(_mm_loadu_si128(
+                    (__m128i const *) blocks), swap);
+        __m128i w1 = _mm_shuffle_epi8(_mm_loadu_si128(
+                    (__m128i const *) (blocks + 16)), swap);
+        __m128i w2 = _mm_shuffle_epi8(_mm_loadu_si128(
+                    (__m128i const *) (blocks + 32)), swap);
+        __m128i w3 = _mm_shuffle_epi8(_mm_loadu_si128(
+                    (__m128i const *) (blocks + 48)), swap);
+        ROUNDS4(w0, 0);
+        ROUNDS4(w1, 1);
+        ROUNDS4(w2, 2);
+        ROUNDS4(w3, 3);
+        for (int i = 4; i < 16; i += 4) {
+            SCHEDULE(w0, w1, w2, w3);
+            ROUNDS4(w0, i);
+            SCHEDULE(w1, w2, w3, w0);
+            ROUNDS4(w1, i + 1);
+            SCHEDULE(w2, w3, w0, w1);
+            ROUNDS4(w2, i + 2);
+            SCHEDULE(w3, w0, w1, w2);
+            ROUNDS4(w3, i + 3);
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+    _mm_storeu_si128((__m128i *) state, _mm_blend_epi16(feba, dchg, 0xf0));
+    _mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+// The multi-buffer kernel runs the scalar rounds on eight messages at once,
+//  one in each 32-bit lane
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), \
+        _mm256_slli_epi32(x, 32 - (n)))
+#define ROUND8(a, b, c, d, e, f, g, h, t) do { \
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, \
+                _mm256_xor_si256(_mm256_xor_si256(ROTR8(e, 6), ROTR8(e, 11)), \
+                    ROTR8(e, 25))), \
+            _mm256_add_epi32(_mm256_xor_si256(_mm256_and_si256(e, f), \
+                    _mm256_andnot_si256(e, g)), \
+                _mm256_add_epi32(_mm256_set1_epi32(K[t]), w[t]))); \
+    d = _mm256_add_epi32(d, t1); \
+    h = _mm256_add_epi32(t1, _mm256_add_epi32(_mm256_xor_si256( \
+                    _mm256_xor_si256(ROTR8(a, 2), ROTR8(a, 13)), \
+                    ROTR8(a, 22)), \
+                _mm256_or_si256(_mm256_and_si256(a, b), \
+                    _mm256_and_si256(c, _mm256_or_si256(a, b))))); \
+} while (0)
+
+__attribute__((target("avx2")))
+static void compress_lanes (__m256i *state, unsigned char const **blocks,
+        size_t n)
+{
+    for (size_t offset = 0; offset < n * BLOCK_LENGTH;
+            offset += BLOCK_LENGTH) {
+        __m256i w[64];
+        for (int t = 0; t < 16; t++)
+            w[t] = _mm256_setr_epi32(load_be32(blocks[0] + offset + 4 * t),
+                    load_be32(blocks[1] + offset + 4 * t),
+                    load_be32(blocks[2] + offset + 4 * t),
+                    load_be32(blocks[3] + offset + 4 * t),
+                    load_be32(blocks[4] + offset + 4 * t),
+                    load_be32(blocks[5] + offset + 4 * t),
+                    load_be32(blocks[6] + offset + 4 * t),
+                    load_be32(blocks[7] + offset + 4 * t));
+        for (int t = 16; t < 64; t++) {
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(
+                        ROTR8(w[t - 15], 7), ROTR8(w[t - 15], 18)),
+                    _mm256_srli_epi32(w[t - 15], 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(
+                        ROTR8(w[t - 2], 17), ROTR8(w[t - 2], 19)),
+                    _mm256_srli_epi32(w[t - 2], 10));
+            w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0),
+                    _mm256_add_epi32(w[t - 7], s1));
+        }
+        __m256i a = state[0], b = state[1], c = state[2], d = state[3],
+            e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; t += 8) {
+            ROUND8(a, b, c, d, e, f, g, h, t);
+            ROUND8(h, a, b, c, d, e, f, g, t + 1);
+            ROUND8(g, h, a, b, c, d, e, f, t + 2);
+            ROUND8(f, g, h, a, b, c, d, e, t + 3);
+            ROUND8(e, f, g, h, a, b, c, d, t + 4);
+            ROUND8(d, e, f, g, h, a, b, c, t + 5);
+            ROUND8(c, d, e, f, g, h, a, b, t + 6);
+            ROUND8(b, c, d, e, f, g, h, a, t + 7);
+        }
+        state[0] = _mm256_add_epi32(state[0], a);
+        state[1] = _mm256_add_epi32(state[1], b);
+        state[2] = _mm256_add_epi32(state[2], c);
+        state[3] = _mm256_add_epi32(state[3], d);
+        state[4] = _mm256_add_epi32(state[4], e);
+        state[5] = _mm256_add_epi32(state[5], f);
+        state[6] = _mm256_add_epi32(state[6], g);
+        state[7] = _mm256_add_epi32(state[7], h);
+    }
+}
+
+// Hashes LANES messages of <length> bytes each
+__attribute__((target("avx2")))
+static void hash_lanes (unsigned char const *const *in, size_t length,
+        unsigned char (*out)[HASH_LENGTH])
+{
+    __m256i state[8];
+    for (int i = 0; i < 8; i++) state[i] = _mm256_set1_epi32(H0[i]);
+    unsigned char const *blocks[LANES];
+    for (int i = 0; i < LANES; i++) blocks[i] = in[i];
+    compress_lanes(state, blocks, length / BLOCK_LENGTH);
+    // The messages share a length, and so the shape of their padding
+    unsigned char tails[LANES][2 * BLOCK_LENGTH];
+    size_t full = length / BLOCK_LENGTH * BLOCK_LENGTH, rest = length - full;
+    size_t n = rest + 9 > BLOCK_LENGTH ? 2 : 1;
+    uint64_t bits = htobe64((uint64_t) length * 8);
+    for (int i = 0; i < LANES; i++) {
+        memset(tails[i], 0, sizeof(tails[i]));
+        memcpy(tails[i], in[i] + full, rest);
+        tails[i][rest] = 0x80;
+        memcpy(tails[i] + n * BLOCK_LENGTH - 8, &bits, sizeof(uint64_t));
+        blocks[i] = tails[i];
+    }
+    compress_lanes(state, blocks, n);
+    uint32_t words[8][LANES];
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *) words[i], state[i]);
+    for (int i = 0; i < LANES; i++) {
+        for (int j = 0; j < 8; j++) {
+            uint32_t word = htobe32(words[j][i]);
+            memcpy(out[i] + 4 * j, &word, sizeof(uint32_t));
+        }
+    }
+}
+#endif
+
+// With the SHA extensions, one message at a time outruns eight in AVX2 lanes
+static void pick_kernels (void)
+{
+    compress = compress_scalar;
+#ifdef X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        compress = compress_sha;
+    else if (__builtin_cpu_supports("avx2"))
+        multi_buffer = true;
+#endif
+}
+
+/// Extern functions
+
+void hash (unsigned char const *in, size_t length, unsigned char *out)
+{
+    pthread_once(&once, pick_kernels);
+    uint32_t state[8];
+    memcpy(state, H0, sizeof(state));
+    size_t full = length / BLOCK_LENGTH * BLOCK_LENGTH, rest = length - full;
+    compress(state, in, length / BLOCK_LENGTH);
+    unsigned char tail[2 * BLOCK_LENGTH] = {0};
+    memcpy(tail, in + full, rest);
+    tail[rest] = 0x80;
+    size_t n = rest + 9 > BLOCK_LENGTH ? 2 : 1;
+    uint64_t bits = htobe64((uint64_t) length * 8);
+    memcpy(tail + n * BLOCK_LENGTH - 8, &bits, sizeof(uint64_t));
+    compress(state, tail, n);
+    for (int i = 0; i < 8; i++) {
+        uint32_t word = htobe32(state[i]);
+        memcpy(out + 4 * i, &word, sizeof(uint32_t));
+    }
+}
+
+void hash_many (unsigned char const *const *in, size_t length,
+        unsigned char (*out)[HASH_LENGTH], size_t n)
+{
+    pthread_once(&once, pick_kernels);
+    size_t i = 0;
+#ifdef X86
+    if (multi_buffer)
+        for (; n - i >= LANES; i += LANES) hash_lanes(in + i, length, out + i);
+#endif
+    for (; i < n; i++) hash(in[i], length, out[i]);
+}
+
+void dsp_hash (void const *in, size_t length, unsigned char *out)
+{
+    hash(in, length, out);
+}
+
+void dsp_hash_blocks (void const *in, size_t length, size_t block_size,
+        unsigned char *out)
+{
+    unsigned char const *blocks[LANES];
+    size_t n = length / block_size;
+    for (size_t i = 0; i < n; i += LANES) {
+        size_t m = n - i < LANES ? n - i : LANES;
+        for (size_t j = 0; j < m; j++)
+            blocks[j] = (unsigned char const *) in + (i + j) * block_size;
+        hash_many(blocks, block_size, (unsigned char (*)[HASH_LENGTH])
+                (out + i * HASH_LENGTH), m);
+    }
+    if (length % block_size)
+        hash((unsigned char const *) in + n * block_size, length % block_size,
+                out + n * HASH_LENGTH);
+}